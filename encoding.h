@@ -2,6 +2,8 @@
 // License: MIT
 #pragma once
 
+#include <string>
+
 inline bool vsk_isupper(char ch)
 {
     return ('A' <= ch && ch <= 'Z');
@@ -40,3 +42,120 @@ inline void vsk_upper(std::string& str)
             ch += ('A' - 'a');
     }
 }
+
+// encodings of the program text
+enum VSK_ENCODING
+{
+    VSK_ENCODING_ASCII,
+    VSK_ENCODING_SJIS,
+    VSK_ENCODING_UTF8,
+};
+
+// classes of bytes
+enum VSK_BYTE_CLASS
+{
+    VSK_BC_OTHER,
+    VSK_BC_ALPHA,
+    VSK_BC_DIGIT,
+    VSK_BC_BLANK,
+    VSK_BC_QUOTE,
+    VSK_BC_DOT,
+    VSK_BC_LEAD2,   // the lead byte of a 2-byte character
+    VSK_BC_LEAD3,   // the lead byte of a 3-byte character
+    VSK_BC_LEAD4,   // the lead byte of a 4-byte character
+};
+
+// the length of the character by the class of the lead byte
+inline size_t vsk_char_len(unsigned char cls)
+{
+    switch (cls)
+    {
+    case VSK_BC_LEAD2: return 2;
+    case VSK_BC_LEAD3: return 3;
+    case VSK_BC_LEAD4: return 4;
+    default: return 1;
+    }
+}
+
+// the byte class table
+struct VSK_BYTE_CLASS_TABLE
+{
+    unsigned char m_classes[256];
+
+    VSK_BYTE_CLASS_TABLE(VSK_ENCODING encoding)
+    {
+        for (int ch = 0; ch < 256; ++ch)
+        {
+            unsigned char cls = VSK_BC_OTHER;
+            if (vsk_isalpha(char(ch)))
+                cls = VSK_BC_ALPHA;
+            else if (vsk_isdigit(char(ch)))
+                cls = VSK_BC_DIGIT;
+            else if (vsk_isblank(char(ch)))
+                cls = VSK_BC_BLANK;
+            else if (ch == '"')
+                cls = VSK_BC_QUOTE;
+            else if (ch == '.')
+                cls = VSK_BC_DOT;
+            else if (encoding == VSK_ENCODING_SJIS)
+            {
+                if ((0x81 <= ch && ch <= 0x9F) || (0xE0 <= ch && ch <= 0xFC))
+                    cls = VSK_BC_LEAD2;
+            }
+            else if (encoding == VSK_ENCODING_UTF8)
+            {
+                if (0xC2 <= ch && ch <= 0xDF)
+                    cls = VSK_BC_LEAD2;
+                else if (0xE0 <= ch && ch <= 0xEF)
+                    cls = VSK_BC_LEAD3;
+                else if (0xF0 <= ch && ch <= 0xF4)
+                    cls = VSK_BC_LEAD4;
+            }
+            m_classes[ch] = cls;
+        }
+    }
+};
+
+// get the byte class table of the encoding
+inline const unsigned char *vsk_byte_classes(VSK_ENCODING encoding)
+{
+    static const VSK_BYTE_CLASS_TABLE s_ascii(VSK_ENCODING_ASCII);
+    static const VSK_BYTE_CLASS_TABLE s_sjis(VSK_ENCODING_SJIS);
+    static const VSK_BYTE_CLASS_TABLE s_utf8(VSK_ENCODING_UTF8);
+    switch (encoding)
+    {
+    case VSK_ENCODING_SJIS: return s_sjis.m_classes;
+    case VSK_ENCODING_UTF8: return s_utf8.m_classes;
+    default: return s_ascii.m_classes;
+    }
+}
+
+// is it a valid UTF-8 text having any non-ASCII character?
+inline bool vsk_is_utf8(const char *str, size_t len)
+{
+    auto classes = vsk_byte_classes(VSK_ENCODING_UTF8);
+    bool non_ascii = false;
+    for (size_t i = 0; i < len; )
+    {
+        unsigned char ch = str[i];
+        if (ch < 0x80)
+        {
+            ++i;
+            continue;
+        }
+
+        size_t cch = vsk_char_len(classes[ch]);
+        if (cch == 1)
+            return false;
+        for (size_t k = 1; k < cch; ++k)
+        {
+            if (i + k >= len) // truncated at the end?
+                return non_ascii;
+            if ((str[i + k] & 0xC0) != 0x80)
+                return false;
+        }
+        non_ascii = true;
+        i += cch;
+    }
+    return non_ascii;
+}
@@ -92,6 +92,11 @@ mstr_join(const T_STR_CONTAINER& container,
     end = container.end();
     if (it != end)
     {
+        size_t size = 0;
+        for (auto it2 = it; it2 != end; ++it2)
+            size += it2->size() + sep.size();
+        result.reserve(size);
+
         result = *it;
         for (++it; it != end; ++it)
         {
@@ -0,0 +1,98 @@
+/* renum-c.h --- C interface of renum by katahiromz */
+/* Copyright (C) 2024 Katayama Hirofumi MZ */
+/* License: MIT */
+
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The result codes (the same values as RENUM_ERROR_CODE) */
+#define RENUM_C_OK                      0
+#define RENUM_C_E_NO_LINE_NUMBER        1   /* No line number found */
+#define RENUM_C_E_LINE_NUMBER_EXISTS    2   /* Line number already exists */
+#define RENUM_C_E_UNDEFINED_LINE        3   /* Undefined line */
+#define RENUM_C_E_UNSORTED_LINE         4   /* Unsorted line */
+#define RENUM_C_E_DUPLICATED_LINE       5   /* Duplicated line */
+#define RENUM_C_E_BUFFER_TOO_SMALL      100 /* The output buffer is too small */
+#define RENUM_C_E_INVALID_ARGUMENT      101 /* Invalid argument */
+#define RENUM_C_E_OUT_OF_MEMORY         102 /* Out of memory */
+
+/* The encodings */
+#define RENUM_C_ENCODING_ASCII  0
+#define RENUM_C_ENCODING_SJIS   1
+#define RENUM_C_ENCODING_UTF8   2
+#define RENUM_C_ENCODING_AUTO   3
+
+/* The options */
+typedef struct RENUM_C_OPTIONS
+{
+    unsigned long new_start;    /* The new starting line number (default: 10) */
+    unsigned long old_start;    /* The old starting line number (default: 0) */
+    unsigned long step;         /* The increment step between lines (default: 10) */
+    int force;                  /* Force renumbering even if an invalid line number */
+    int encoding;               /* RENUM_C_ENCODING_* (default: RENUM_C_ENCODING_AUTO) */
+} RENUM_C_OPTIONS;
+
+/* The error information */
+typedef struct RENUM_C_ERROR
+{
+    int code;                   /* RENUM_C_OK or RENUM_C_E_* */
+    size_t line;                /* The physical line index (1-based; 0 if unknown) */
+    size_t column;              /* The byte column in the line (1-based; 0 if unknown) */
+    unsigned long lineno;       /* The line number of the line (0 if unknown) */
+    unsigned long target;       /* The undefined line number */
+} RENUM_C_ERROR;
+
+/**
+ * @brief Initializes the options by the default values.
+ * @param options The options to initialize.
+ */
+void RENUM_C_default_options(RENUM_C_OPTIONS *options);
+
+/**
+ * @brief Renumbers the lines of a BASIC program text.
+ *
+ * The output is not null-terminated. If output_size is too small (or output
+ * is NULL), RENUM_C_E_BUFFER_TOO_SMALL is returned and *output_len receives
+ * the required size. Nothing is kept between the calls; give a large enough
+ * buffer at once to renumber the text only once.
+ * @param input The BASIC program text.
+ * @param input_len The length of the input in bytes.
+ * @param output The buffer to receive the renumbered text (or NULL).
+ * @param output_size The size of the output buffer in bytes.
+ * @param output_len Receives the length of the renumbered text.
+ * @param options The options (or NULL for the default).
+ * @param error Receives the error information (or NULL).
+ * @return RENUM_C_OK or RENUM_C_E_*.
+ */
+int RENUM_C_renumber_lines(
+    const char *input,
+    size_t input_len,
+    char *output,
+    size_t output_size,
+    size_t *output_len,
+    const RENUM_C_OPTIONS *options,
+    RENUM_C_ERROR *error);
+
+/**
+ * @brief Adds line numbers to a BASIC program text.
+ *
+ * The buffers are the same as RENUM_C_renumber_lines. old_start is not used.
+ * @return RENUM_C_OK or RENUM_C_E_*.
+ */
+int RENUM_C_add_line_numbers(
+    const char *input,
+    size_t input_len,
+    char *output,
+    size_t output_size,
+    size_t *output_len,
+    const RENUM_C_OPTIONS *options,
+    RENUM_C_ERROR *error);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
@@ -2,20 +2,73 @@
 // Copyright (C) 2024 Katayama Hirofumi MZ
 // License: MIT
 #include "renum.h"
+#include "renum-c.h"
 #include <vector>
 #include <map>
 #include <algorithm>
 #include <cstring>
 #include <cstdio>
 #include <cassert>
+#include <cerrno>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <iterator>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+    #include <windows.h>
+    #include <io.h>
+    #include <fcntl.h>
+    #include <process.h>
+    #include <direct.h>
+    #include <sys/utime.h>
+#else
+    #include <unistd.h>
+    #include <climits>
+    #include <dirent.h>
+    #include <utime.h>
+    #include <sys/uio.h>
+    #include <sys/mman.h>
+    #include <fcntl.h>
+    #include <sys/file.h>
+    #ifdef __linux__
+        #include <sys/ioctl.h>
+        #include <linux/fs.h>
+    #endif
+    #ifdef RENUM_HAVE_IO_URING
+        #include <sys/syscall.h>
+        #include <sys/eventfd.h>
+        #include <linux/io_uring.h>
+    #endif
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define RENUM_HAVE_SSE2
+#endif
+#ifdef RENUM_HAVE_ZLIB
+    #include <zlib.h>
+#endif
+#ifdef RENUM_HAVE_ZSTD
+    #include <zstd.h>
+#endif
+#if (defined(RENUM_HAVE_ZLIB) || defined(RENUM_HAVE_ZSTD)) && \
+    (defined(__GLIBC__) || defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__))
+    #define RENUM_HAVE_COMPRESSION  // fopencookie or funopen
+#endif
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 #include "mstr.h"
 #include "encoding.h"
 #include "config.h"
 
+#define RENUM_VERSION "1.2.6"
+
 // version info
 void RENUM_version(void)
 {
-    std::printf("renum Version 1.2.6 by katahiromz\n");
+    std::printf("renum Version %s by katahiromz\n", RENUM_VERSION);
 }
 
 #define RENUM_DEFAULT_OUTPUT "output.bas"
@@ -29,17 +82,59 @@ void RENUM_usage(void)
         "RENUM --- Renumber BASIC program lines\n"
         "\n"
         "Usage: renum [OPTIONS] -i your_file.bas -o output.bas\n"
+        "       renum translate [--all-numbers] MAP [LOG [OUTPUT]]\n"
         "\n"
         "Options:\n"
         "  -i FILE                  Specify the input BASIC file to be renumbered.\n"
+        "                           If specified more than once, the files in the order\n"
+        "                           share one line number space (MERGE/CHAIN) and are\n"
+        "                           renumbered in place. A file compressed by gzip or\n"
+        "                           zstd is decompressed.\n"
         "  -o FILE                  Specify the output file (default: %s).\n"
+        "                           It is compressed if the extension is .gz or .zst.\n"
         "  --new-start LINE_NUMBER  Set the new starting line number (default: %d).\n"
         "  --old-start LINE_NUMBER  Set the old starting line number (default: 0).\n"
         "  --step STEP              Set the increment step between lines (default: %d).\n"
         "  --force                  Force renumbering even if any invalid line number.\n"
+        "  --check                  Check the line numbers only without writing (exit code:\n"
+        "                           0 if canonical, 1 if any problem, 2 if to be renumbered).\n"
+        "  --fail-fast              Stop checking at the first problem.\n"
+        "  --diff                   Write the changes as a unified diff instead.\n"
+        "  --edits                  Write the changes as an edit list instead (offset,\n"
+        "                           old text and new text separated by tabs; \\t, \\r,\n"
+        "                           \\n and \\\\ escaped). The lines of --diff and --edits\n"
+        "                           must be sorted because the changes never move lines.\n"
+        "  --sync                   Flush the output file to the storage before replacing.\n"
+        "  --memory-limit MB        Sort and renumber with bounded memory by spilling\n"
+        "                           sorted runs to temporary files.\n"
+        "  --jobs N                 Overlap reading, renumbering by N threads and writing.\n"
+        "  --encoding ENCODING      Set the encoding of the program (auto, sjis, utf8 or\n"
+        "                           ascii; default: auto).\n"
+        "  --minimal                Renumber as few lines as possible to make the line\n"
+        "                           numbers ascending without sorting.\n"
+        "  --gap LINE:COUNT[,...]   Leave COUNT line numbers unused after the old LINE\n"
+        "                           (implies --minimal).\n"
+        "  --cache DIR              Reuse the results of the same inputs and options\n"
+        "                           cached in the directory.\n"
+        "  --cache-size MB          Set the maximum size of the cache (default: 256).\n"
+        "  --cache-stats            Display the statistics of the cache and exit.\n"
+        "  --batch LIST             Renumber the files listed in LIST (\"INPUT\" or\n"
+        "                           \"INPUT<TAB>OUTPUT\" per line; default: in place)\n"
+        "                           by the asynchronous I/O and --jobs threads.\n"
+        "  --io ENGINE              Set the I/O engine of --batch (auto, uring or\n"
+        "                           threads; default: auto).\n"
+        "  --journal FILE           Record the finished files of --batch in FILE and\n"
+        "                           skip the verified ones when run again.\n"
+        "  --map FILE               Write the map of the old and new line numbers as a\n"
+        "                           binary file for 'renum translate'.\n"
+        "  --map-text FILE          Write the map as a text file (OLD<TAB>NEW per line).\n"
         "  --help                   Display this help message and exit.\n"
         "  --version                Display version information and exit.\n"
         "\n"
+        "'renum translate' rewrites the old line numbers after \"in\", \"line\" or \"at\"\n"
+        "(or all the numbers by --all-numbers) in LOG (default: stdin) by MAP and\n"
+        "writes OUTPUT (default: stdout).\n"
+        "\n"
         "For support or further information, please contact: katayama.hirofumi.mz@gmail.com\n",
         RENUM_DEFAULT_OUTPUT, RENUM_LINENO_START, RENUM_LINENO_STEP);
 }
@@ -49,11 +144,30 @@ typedef std::map<renum_lineno_t, renum_lineno_t> VskLineNoMap;
 struct RENUM
 {
     std::map<std::string, std::string> m_options;
+    std::vector<std::string> m_inputs;
     renum_lineno_t m_new_start = RENUM_LINENO_START;
     renum_lineno_t m_old_start = 0;
     renum_lineno_t m_step = RENUM_LINENO_STEP;
     bool m_bom = false;
     bool m_force = false;
+    bool m_check = false;
+    bool m_fail_fast = false;
+    bool m_diff = false;
+    bool m_edits = false;
+    bool m_sync = false;
+    size_t m_memory_limit = 0;
+    size_t m_jobs = 0;
+    bool m_auto_encoding = true;
+    std::string m_cache_dir;
+    unsigned long long m_cache_size = 256ULL * 1024 * 1024;
+    bool m_cache_stats = false;
+    bool m_minimal = false;
+    std::vector<RENUM_GAP> m_gaps;
+    std::string m_batch;
+    std::string m_journal;
+    std::string m_map_file;
+    std::string m_map_text_file;
+    RENUM_IO_ENGINE m_io_engine = RENUM_IO_AUTO;
 };
 
 // is it a line number?
@@ -87,14 +201,143 @@ RENUM_TOKEN RENUM_word2token(const std::string& word)
     return RT_MAX;
 }
 
+// the keywords that can introduce the line number references
+// (TO and SUB follow GO; the comma and the minus follow these)
+static const char * const s_renum_triggers[] =
+{
+    "GO", "THEN", "ELSE", "RESUME", "RESTORE", "RUN", "RETURN", "LIST", "DELETE", "EDIT", "AUTO"
+};
+
+// does a trigger keyword begin at str (ignoring case)?
+inline bool RENUM_is_trigger(const char *str, const char *end)
+{
+    for (auto trigger : s_renum_triggers)
+    {
+        const char *pch = str;
+        for (; *trigger && pch < end; ++trigger, ++pch)
+        {
+            if ((*pch & 0xDF) != *trigger)
+                break;
+        }
+        if (!*trigger)
+            return true;
+    }
+    return false;
+}
+
+// may the line refer to any line number? (false if it has no trigger keyword)
+bool RENUM_may_refer_line_numbers(const char *str, size_t len)
+{
+    const char *end = str + len;
+    size_t ich = 0;
+#ifdef RENUM_HAVE_SSE2
+    // find the first two letters of the triggers in 16 positions at once
+    const __m128i lower = _mm_set1_epi8(0x20);
+    for (; ich + 17 <= len; ich += 16)
+    {
+        __m128i a = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(str + ich)), lower);
+        __m128i b = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(str + ich + 1)), lower);
+#define RENUM_PAIR(c1, c2) \
+        _mm_and_si128(_mm_cmpeq_epi8(a, _mm_set1_epi8(c1)), _mm_cmpeq_epi8(b, _mm_set1_epi8(c2)))
+        __m128i m = _mm_or_si128(_mm_or_si128(RENUM_PAIR('g', 'o'), RENUM_PAIR('t', 'h')),
+                                 _mm_or_si128(RENUM_PAIR('e', 'l'), RENUM_PAIR('e', 'd')));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_or_si128(RENUM_PAIR('r', 'e'), RENUM_PAIR('r', 'u')),
+                                         _mm_or_si128(RENUM_PAIR('l', 'i'), RENUM_PAIR('d', 'e'))));
+        m = _mm_or_si128(m, RENUM_PAIR('a', 'u'));
+#undef RENUM_PAIR
+        int mask = _mm_movemask_epi8(m);
+        for (int i = 0; mask; ++i, mask >>= 1)
+        {
+            if ((mask & 1) && RENUM_is_trigger(str + ich + i, end))
+                return true;
+        }
+    }
+#endif
+    for (; ich < len; ++ich)
+    {
+        if (RENUM_is_trigger(str + ich, end))
+            return true;
+    }
+    return false;
+}
+
+// the encoding of the program text
+static thread_local RENUM_ENCODING s_renum_encoding = RENUM_ENCODING_ASCII;
+
+void RENUM_set_encoding(RENUM_ENCODING encoding)
+{
+    s_renum_encoding = encoding;
+}
+
+RENUM_ENCODING RENUM_get_encoding(void)
+{
+    return s_renum_encoding;
+}
+
+// the last error
+static thread_local RENUM_ERROR_INFO s_renum_error;
+static thread_local bool s_renum_quiet = false;
+
+const RENUM_ERROR_INFO& RENUM_get_last_error(void)
+{
+    return s_renum_error;
+}
+
+// the line map to receive the mapping of the renumbering (nullptr if none)
+static thread_local RENUM_LINE_MAP *s_renum_line_map = nullptr;
+
+// give the mapping of the renumbering to the line map
+void RENUM_emit_line_map(const VskLineNoMap& old_to_new_line)
+{
+    if (s_renum_line_map)
+        s_renum_line_map->assign(old_to_new_line.begin(), old_to_new_line.end());
+}
+
+void RENUM_set_quiet(bool quiet)
+{
+    s_renum_quiet = quiet;
+}
+
+// report an error
+void
+RENUM_report_error(
+    const std::string& msg,
+    int code,
+    size_t line = 0,
+    renum_lineno_t lineno = 0,
+    renum_lineno_t target = 0,
+    size_t column = 0)
+{
+    s_renum_error = RENUM_ERROR_INFO { code, line, column, lineno, target };
+    if (!s_renum_quiet)
+        RENUM_ERROR_MESSAGE(msg);
+}
+
+// detect the encoding of the program text
+RENUM_ENCODING RENUM_detect_encoding(const char *text, size_t len, bool bom)
+{
+    if (bom || vsk_is_utf8(text, len))
+        return RENUM_ENCODING_UTF8;
+
+    // no decisive byte
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (text[i] & 0x80)
+            return RENUM_ENCODING_SJIS;
+    }
+    return RENUM_ENCODING_ASCII;
+}
+
 // The tokenizer
 struct RENUM_Tokenizer
 {
     std::string& m_str;
     size_t m_ich, m_cch;
+    const unsigned char *m_classes;
 
-    RENUM_Tokenizer(std::string& str) : m_str(str)
+    RENUM_Tokenizer(std::string& str, RENUM_ENCODING encoding = RENUM_get_encoding()) : m_str(str)
     {
+        m_classes = vsk_byte_classes(VSK_ENCODING(encoding));
         reset();
     }
 
@@ -114,12 +357,24 @@ struct RENUM_Tokenizer
         return m_str[m_ich];
     }
 
+    unsigned char get_class() const
+    {
+        assert(!is_eof());
+        return m_classes[(unsigned char)m_str[m_ich]];
+    }
+
     void next()
     {
         assert(!is_eof());
         ++m_ich;
     }
 
+    // skip the current character (the trail bytes are never seen as ASCII)
+    void next_char(unsigned char cls)
+    {
+        m_ich = std::min(m_ich + vsk_char_len(cls), m_str.size());
+    }
+
     std::string get_word()
     {
         if (m_cch == 0)
@@ -140,8 +395,7 @@ struct RENUM_Tokenizer
     {
         while (!is_eof())
         {
-            char ch = getch();
-            if (!vsk_isblank(ch))
+            if (get_class() != VSK_BC_BLANK)
                 break;
             next();
         }
@@ -158,64 +412,52 @@ struct RENUM_Tokenizer
 
         if (is_eof()) return "";
 
-        std::string ret;
-
         size_t ich = m_ich;
-        char ch = getch();
-        ret += ch;
-        next();
+        unsigned char cls = get_class();
+        next_char(cls);
 
-        if (vsk_isalpha(ch)) // identifier?
+        if (cls == VSK_BC_ALPHA) // identifier?
         {
             while (!is_eof())
             {
-                ch = getch();
-                if (vsk_isalnum(ch) || ch == '.')
-                    ret += ch;
-                else
+                cls = get_class();
+                if (cls != VSK_BC_ALPHA && cls != VSK_BC_DIGIT && cls != VSK_BC_DOT)
                     break;
                 next();
             }
+            m_cch = m_ich - ich;
             m_ich = ich;
-            m_cch = ret.size();
+            auto ret = m_str.substr(m_ich, m_cch);
             vsk_upper(ret);
             return ret;
         }
-        else if (vsk_isdigit(ch)) // numeric?
+        else if (cls == VSK_BC_DIGIT) // numeric?
         {
             while (!is_eof())
             {
-                ch = getch();
-                if (vsk_isdigit(ch) || ch == '.')
-                    ret += ch;
-                else
+                cls = get_class();
+                if (cls != VSK_BC_DIGIT && cls != VSK_BC_DOT)
                     break;
                 next();
             }
-            m_ich = ich;
-            m_cch = ret.size();
-            return ret;
         }
-        else if (ch == '"') // quote?
+        else if (cls == VSK_BC_QUOTE) // quote?
         {
             while (!is_eof())
             {
-                ch = getch();
-                ret += ch;
-                if (ch == '"')
+                cls = get_class();
+                if (cls == VSK_BC_QUOTE)
+                {
+                    next();
                     break;
-                next();
+                }
+                next_char(cls);
             }
-            m_ich = ich;
-            m_cch = ret.size();
-            return ret;
-        }
-        else
-        {
-            m_ich = ich;
-            m_cch = 1;
-            return ret;
         }
+
+        m_cch = m_ich - ich;
+        m_ich = ich;
+        return m_str.substr(m_ich, m_cch);
     }
 };
 
@@ -267,6 +509,28 @@ void RENUM_tokenizer_tests(void)
         word = tokenizer.get_next_word();
         assert(word == "190");
     }
+    {
+        str = "\x83\x47OTO 110";
+        RENUM_Tokenizer tokenizer(str, RENUM_ENCODING_SJIS);
+        word = tokenizer.get_next_word();
+        assert(word == "\x83\x47");
+        word = tokenizer.get_next_word();
+        assert(word == "OTO");
+    }
+    {
+        str = "PRINT \"\xE3\x81\x82\",\xE3\x81";
+        RENUM_Tokenizer tokenizer(str, RENUM_ENCODING_UTF8);
+        word = tokenizer.get_next_word();
+        assert(word == "PRINT");
+        word = tokenizer.get_next_word();
+        assert(word == "\"\xE3\x81\x82\"");
+        word = tokenizer.get_next_word();
+        assert(word == ",");
+        word = tokenizer.get_next_word();
+        assert(word == "\xE3\x81");
+        word = tokenizer.get_next_word();
+        assert(word == "");
+    }
     {
         str = "PRINT \"TEST\", 130";
         RENUM_Tokenizer tokenizer(str);
@@ -279,6 +543,16 @@ void RENUM_tokenizer_tests(void)
         word = tokenizer.get_next_word();
         assert(word == "130");
     }
+    {
+        // the default is byte-transparent
+        str = "10 PRINT \"\xE3\x81\x82\":GOTO 10\n";
+        assert(RENUM_get_encoding() == RENUM_ENCODING_ASCII);
+        assert(RENUM_renumber_lines(str, 100) == 0);
+        assert(str == "100 PRINT \"\xE3\x81\x82\":GOTO 100\n");
+    }
+    assert(RENUM_detect_encoding("10 END", 6, false) == RENUM_ENCODING_ASCII);
+    assert(RENUM_detect_encoding("10 \x82\xA0", 5, false) == RENUM_ENCODING_SJIS);
+    assert(RENUM_detect_encoding("10 \xE3\x81\x82", 6, false) == RENUM_ENCODING_UTF8);
 }
 
 // get the line number
@@ -294,6 +568,62 @@ renum_lineno_t RENUM_line_number_from_line_text(const std::string& line, char **
     return renum_lineno_t(number);
 }
 
+// get the line number of the line [ich, ich_end) in the text without copying it
+renum_lineno_t
+RENUM_line_number_in_text(const std::string& text, size_t ich, size_t ich_end, size_t *pich_body = nullptr)
+{
+    // the same as RENUM_line_number_from_line_text but not beyond the line
+    size_t ich_top = ich;
+    while (ich_top < ich_end && std::strchr(" \t\r\v\f", text[ich_top]))
+        ++ich_top;
+    if (pich_body)
+        *pich_body = ich;
+    if (ich_top >= ich_end)
+        return 0;
+
+    char *endptr;
+    auto number = std::strtoul(&text[ich_top], &endptr, 10);
+    size_t ich_body = endptr - &text[0];
+    if (ich_body == ich_top)
+        return 0;
+    if (ich_body < ich_end && text[ich_body] == ' ')
+        ++ich_body;
+    if (pich_body)
+        *pich_body = ich_body;
+
+    return renum_lineno_t(number);
+}
+
+// join the lines into the exact-size buffer
+void RENUM_join_lines(std::string& text, const std::vector<std::string>& lines)
+{
+    size_t size = 0;
+    for (auto& line : lines)
+        size += line.size() + 1;
+
+    text.clear();
+    text.reserve(size);
+    for (auto& line : lines)
+    {
+        if (&line != &lines[0])
+            text += '\n';
+        text += line;
+    }
+#ifdef RENUM_APPEND_NEWLINE
+    text += '\n';
+#endif
+}
+
+// sort the lines by line numbers
+void RENUM_sort_lines(std::vector<std::string>& lines)
+{
+    std::sort(lines.begin(), lines.end(), [](const std::string& line0, const std::string& line1){
+        auto number0 = RENUM_line_number_from_line_text(line0);
+        auto number1 = RENUM_line_number_from_line_text(line1);
+        return number0 < number1;
+    });
+}
+
 // sort by line numbers
 void RENUM_sort_by_line_numbers(std::string& text)
 {
@@ -304,99 +634,714 @@ void RENUM_sort_by_line_numbers(std::string& text)
     std::vector<std::string> lines;
     mstr_split(lines, text, "\n");
 
-    std::sort(lines.begin(), lines.end(), [](const std::string& line0, const std::string& line1){
-        auto number0 = RENUM_line_number_from_line_text(line0);
-        auto number1 = RENUM_line_number_from_line_text(line1);
-        return number0 < number1;
-    });
+    RENUM_sort_lines(lines);
 
     // join the lines
-    text = std::move(mstr_join(lines, "\n"));
-#ifdef RENUM_APPEND_NEWLINE
-    text += '\n';
-#endif
+    RENUM_join_lines(text, lines);
 }
 
-// load a text file
-renum_error_t RENUM_load_file(const std::string& filename, std::string& text, bool& bom)
+// the compression formats
+enum RENUM_COMPRESSION
 {
-    text.clear();
+    RENUM_COMPRESSION_NONE,
+    RENUM_COMPRESSION_GZIP,
+    RENUM_COMPRESSION_ZSTD,
+};
 
-    FILE *fin = fopen(filename.c_str(), "r");
-    if (!fin)
+// the compression format by the magic bytes
+RENUM_COMPRESSION RENUM_compression_of_data(const void *data, size_t size)
+{
+    auto p = static_cast<const unsigned char *>(data);
+    if (size >= 2 && p[0] == 0x1F && p[1] == 0x8B)
+        return RENUM_COMPRESSION_GZIP;
+    if (size >= 4 && p[0] == 0x28 && p[1] == 0xB5 && p[2] == 0x2F && p[3] == 0xFD)
+        return RENUM_COMPRESSION_ZSTD;
+    return RENUM_COMPRESSION_NONE;
+}
+
+// the compression format by the extension
+RENUM_COMPRESSION RENUM_compression_of_filename(const std::string& filename)
+{
+    auto ich = filename.find_last_of("./\\");
+    if (ich == filename.npos || filename[ich] != '.')
+        return RENUM_COMPRESSION_NONE;
+    std::string ext = filename.substr(ich + 1);
+    vsk_upper(ext);
+    if (ext == "GZ")
+        return RENUM_COMPRESSION_GZIP;
+    if (ext == "ZST")
+        return RENUM_COMPRESSION_ZSTD;
+    return RENUM_COMPRESSION_NONE;
+}
+
+#ifdef RENUM_HAVE_COMPRESSION
+
+#define RENUM_COMPRESSED_BUF (128 * 1024)
+
+// the compressed stream behind a FILE
+struct RENUM_COMPRESSED_FILE
+{
+    FILE *m_raw;
+    RENUM_COMPRESSION m_compression;
+    bool m_writing;
+    bool m_eof = false;
+    bool m_ended = false;       // at the end of the compressed stream?
+    std::vector<char> m_buf;
+    size_t m_ibuf = 0, m_cbuf = 0;  // the unread input in m_buf
+#ifdef RENUM_HAVE_ZLIB
+    z_stream m_zs;
+    bool m_zs_ready = false;
+#endif
+#ifdef RENUM_HAVE_ZSTD
+    ZSTD_DCtx *m_dctx = nullptr;
+    ZSTD_CCtx *m_cctx = nullptr;
+#endif
+
+    RENUM_COMPRESSED_FILE(FILE *raw, RENUM_COMPRESSION compression, bool writing)
+        : m_raw(raw), m_compression(compression), m_writing(writing), m_buf(RENUM_COMPRESSED_BUF)
     {
-        std::fprintf(stderr, "renum: error: Unable to open file '%s'\n", filename.c_str());
-        return 1;
     }
 
-    char buf[512];
-    if (std::fgets(buf, sizeof(buf), fin))
+    ~RENUM_COMPRESSED_FILE()
     {
-        if (std::memcmp(buf, UTF8_BOM, 3) == 0)
+#ifdef RENUM_HAVE_ZLIB
+        if (m_zs_ready)
         {
-            bom = true;
-            text += &buf[3];
+            if (m_writing)
+                deflateEnd(&m_zs);
+            else
+                inflateEnd(&m_zs);
         }
-        else
+#endif
+#ifdef RENUM_HAVE_ZSTD
+        ZSTD_freeDCtx(m_dctx);
+        ZSTD_freeCCtx(m_cctx);
+#endif
+        if (m_raw)
+            std::fclose(m_raw);
+    }
+
+    // the prefix already read from the raw file
+    void unread(const void *data, size_t size)
+    {
+        std::memcpy(m_buf.data(), data, size);
+        m_ibuf = 0;
+        m_cbuf = size;
+    }
+
+    bool init()
+    {
+        switch (m_compression)
         {
-            text += buf;
+        case RENUM_COMPRESSION_NONE:
+            return !m_writing;
+        case RENUM_COMPRESSION_GZIP:
+#ifdef RENUM_HAVE_ZLIB
+            std::memset(&m_zs, 0, sizeof(m_zs));
+            if (m_writing)
+                m_zs_ready = (deflateInit2(&m_zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                                           Z_DEFAULT_STRATEGY) == Z_OK);
+            else
+                m_zs_ready = (inflateInit2(&m_zs, 15 + 16) == Z_OK);
+            return m_zs_ready;
+#else
+            return false;
+#endif
+        case RENUM_COMPRESSION_ZSTD:
+#ifdef RENUM_HAVE_ZSTD
+            if (m_writing)
+                m_cctx = ZSTD_createCCtx();
+            else
+                m_dctx = ZSTD_createDCtx();
+            return m_cctx || m_dctx;
+#else
+            return false;
+#endif
         }
+        return false;
+    }
 
-        while (std::fgets(buf, sizeof(buf), fin))
+    // fill the input buffer (returns false at the end of the raw file)
+    bool fill()
+    {
+        if (m_ibuf < m_cbuf)
+            return true;
+        m_ibuf = 0;
+        m_cbuf = std::fread(m_buf.data(), 1, m_buf.size(), m_raw);
+        return m_cbuf > 0;
+    }
+
+    // does the next gzip member follow? (the magic bytes are in the buffer if any)
+    bool next_member()
+    {
+        if (m_cbuf - m_ibuf == 1)
         {
-            text += buf;
+            m_buf[0] = m_buf[m_ibuf];
+            m_ibuf = 0;
+            m_cbuf = 1 + std::fread(&m_buf[1], 1, m_buf.size() - 1, m_raw);
         }
+        return m_cbuf - m_ibuf >= 2 && (unsigned char)m_buf[m_ibuf] == 0x1F &&
+               (unsigned char)m_buf[m_ibuf + 1] == 0x8B;
     }
 
-    // Cut '\x1A' and after
-    auto i0 = text.find('\x1A');
-    if (i0 != text.npos)
-        text.erase(i0);
+    // returns -1 on error
+    long read(char *data, size_t size)
+    {
+        size_t done = 0;
+        while (done == 0 && size > 0 && !m_eof)
+        {
+            if (!fill())
+            {
+                if (std::ferror(m_raw))
+                    return -1;
+                m_eof = true;
+                // the truncated stream
+                if (m_compression != RENUM_COMPRESSION_NONE && !m_ended)
+                    return -1;
+                break;
+            }
 
-    std::fclose(fin);
-    return 0;
-}
+            switch (m_compression)
+            {
+            case RENUM_COMPRESSION_NONE:
+                done = std::min(size, m_cbuf - m_ibuf);
+                std::memcpy(data, &m_buf[m_ibuf], done);
+                m_ibuf += done;
+                break;
+            case RENUM_COMPRESSION_GZIP:
+#ifdef RENUM_HAVE_ZLIB
+                {
+                    // the padding or the trailing garbage after a member is ignored as gzip does
+                    if (m_ended && m_zs.total_in == 0 && !next_member())
+                    {
+                        m_eof = true;
+                        break;
+                    }
 
-// save a text file
-renum_error_t RENUM_save_file(const std::string& filename, const std::string& text, bool bom)
-{
-    FILE *fout = fopen(filename.c_str(), "w");
-    if (!fout)
-    {
-        std::fprintf(stderr, "renum: error: Unable to open file '%s'\n", filename.c_str());
-        return 1;
+                    m_zs.next_in = reinterpret_cast<Bytef *>(&m_buf[m_ibuf]);
+                    m_zs.avail_in = uInt(m_cbuf - m_ibuf);
+                    m_zs.next_out = reinterpret_cast<Bytef *>(data);
+                    m_zs.avail_out = uInt(std::min<size_t>(size, UINT_MAX));
+                    int ret = inflate(&m_zs, Z_NO_FLUSH);
+                    m_ibuf = m_cbuf - m_zs.avail_in;
+                    done = reinterpret_cast<char *>(m_zs.next_out) - data;
+                    if (ret == Z_STREAM_END)
+                    {
+                        // the next member may follow
+                        m_ended = true;
+                        inflateReset(&m_zs);
+                    }
+                    else if (ret == Z_OK)
+                        m_ended = false;
+                    else if (ret != Z_BUF_ERROR)
+                        return -1;
+                }
+#endif
+                break;
+            case RENUM_COMPRESSION_ZSTD:
+#ifdef RENUM_HAVE_ZSTD
+                {
+                    ZSTD_inBuffer in = { &m_buf[0], m_cbuf, m_ibuf };
+                    ZSTD_outBuffer out = { data, size, 0 };
+                    size_t ret = ZSTD_decompressStream(m_dctx, &out, &in);
+                    if (ZSTD_isError(ret))
+                        return -1;
+                    m_ibuf = in.pos;
+                    done = out.pos;
+                    m_ended = (ret == 0);
+                }
+#endif
+                break;
+            }
+        }
+        return long(done);
     }
 
-    if (bom)
-        std::fwrite(UTF8_BOM, 3, 1, fout);
+    // compress the data (returns false on error)
+    bool write(const char *data, size_t size, bool finish)
+    {
+        switch (m_compression)
+        {
+        case RENUM_COMPRESSION_NONE:
+            return false;
+        case RENUM_COMPRESSION_GZIP:
+#ifdef RENUM_HAVE_ZLIB
+            {
+                m_zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+                m_zs.avail_in = uInt(size);
+                int ret;
+                do
+                {
+                    m_zs.next_out = reinterpret_cast<Bytef *>(m_buf.data());
+                    m_zs.avail_out = uInt(m_buf.size());
+                    ret = deflate(&m_zs, finish ? Z_FINISH : Z_NO_FLUSH);
+                    if (ret == Z_STREAM_ERROR)
+                        return false;
+                    size_t cb = m_buf.size() - m_zs.avail_out;
+                    if (cb && std::fwrite(m_buf.data(), cb, 1, m_raw) != 1)
+                        return false;
+                } while (m_zs.avail_in || (finish && ret != Z_STREAM_END));
+                return true;
+            }
+#else
+            return false;
+#endif
+        case RENUM_COMPRESSION_ZSTD:
+#ifdef RENUM_HAVE_ZSTD
+            {
+                ZSTD_inBuffer in = { data, size, 0 };
+                size_t ret;
+                do
+                {
+                    ZSTD_outBuffer out = { m_buf.data(), m_buf.size(), 0 };
+                    ret = ZSTD_compressStream2(m_cctx, &out, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+                    if (ZSTD_isError(ret))
+                        return false;
+                    if (out.pos && std::fwrite(m_buf.data(), out.pos, 1, m_raw) != 1)
+                        return false;
+                } while (in.pos < in.size || (finish && ret != 0));
+                return true;
+            }
+#else
+            return false;
+#endif
+        }
+        return false;
+    }
 
-    if (!std::fwrite(text.c_str(), text.size(), 1, fout))
+    // finish the stream and close the raw file
+    bool close()
     {
-        std::fprintf(stderr, "renum: error: Unable to write file '%s'\n", filename.c_str());
-        std::fclose(fout);
-        return 1;
+        bool ok = true;
+        if (m_writing)
+            ok = write(nullptr, 0, true);
+        if (std::fclose(m_raw) != 0)
+            ok = false;
+        m_raw = nullptr;
+        return ok;
     }
+};
 
-    std::fclose(fout);
-    return 0;
+#ifdef __GLIBC__
+ssize_t RENUM_cookie_read(void *cookie, char *buf, size_t size)
+{
+    return static_cast<RENUM_COMPRESSED_FILE *>(cookie)->read(buf, size);
 }
 
-// insert line numbers to each top of lines
-renum_error_t
-RENUM_add_line_numbers(
-    std::string& text,
-    renum_lineno_t start,
-    renum_lineno_t step,
-    bool force)
+ssize_t RENUM_cookie_write(void *cookie, const char *buf, size_t size)
 {
-    // trim the space of right side
-    mstr_trim_right(text, " \t\r\n");
+    return static_cast<RENUM_COMPRESSED_FILE *>(cookie)->write(buf, size, false) ? ssize_t(size) : 0;
+}
+#else
+int RENUM_cookie_read(void *cookie, char *buf, int size)
+{
+    return int(static_cast<RENUM_COMPRESSED_FILE *>(cookie)->read(buf, size_t(size)));
+}
 
-    // split to lines
-    std::vector<std::string> lines;
-    mstr_split(lines, text, "\n");
+int RENUM_cookie_write(void *cookie, const char *buf, int size)
+{
+    return static_cast<RENUM_COMPRESSED_FILE *>(cookie)->write(buf, size_t(size), false) ? size : -1;
+}
+#endif
 
-    renum_lineno_t line_no = start;
+int RENUM_cookie_close(void *cookie)
+{
+    auto file = static_cast<RENUM_COMPRESSED_FILE *>(cookie);
+    bool ok = file->close();
+    delete file;
+    return ok ? 0 : EOF;
+}
+
+// open the FILE of the compressed stream (the raw file is owned by it)
+FILE *RENUM_open_compressed(FILE *raw, RENUM_COMPRESSION compression, bool writing,
+                            const void *prefix = nullptr, size_t prefix_size = 0)
+{
+    auto file = new RENUM_COMPRESSED_FILE(raw, compression, writing);
+    if (!file->init())
+    {
+        delete file;
+        return nullptr;
+    }
+    file->unread(prefix, prefix_size);
+
+#ifdef __GLIBC__
+    cookie_io_functions_t io = { RENUM_cookie_read, RENUM_cookie_write, nullptr, RENUM_cookie_close };
+    FILE *fp = fopencookie(file, writing ? "w" : "r", io);
+#else
+    FILE *fp = funopen(file, writing ? nullptr : RENUM_cookie_read,
+                       writing ? RENUM_cookie_write : nullptr, nullptr, RENUM_cookie_close);
+#endif
+    if (!fp)
+        delete file;
+    return fp;
+}
+
+// decompress the data already in memory
+bool RENUM_decompress_data(std::string& data)
+{
+    auto compression = RENUM_compression_of_data(data.c_str(), data.size());
+    FILE *raw = fmemopen(&data[0], data.size(), "r");
+    if (!raw)
+        return false;
+    FILE *fp = RENUM_open_compressed(raw, compression, false);
+    if (!fp)
+        return false;
+
+    std::string text;
+    char buf[RENUM_COMPRESSED_BUF];
+    size_t size;
+    while ((size = std::fread(buf, 1, sizeof(buf), fp)) > 0)
+        text.append(buf, size);
+    bool ok = !std::ferror(fp);
+    if (std::fclose(fp) != 0)
+        ok = false;
+    if (ok)
+        data.swap(text);
+    return ok;
+}
+
+// compress the data in memory
+bool RENUM_compress_data(std::string& data, RENUM_COMPRESSION compression)
+{
+    char *buf = nullptr;
+    size_t size = 0;
+    FILE *raw = open_memstream(&buf, &size);
+    if (!raw)
+        return false;
+    FILE *fp = RENUM_open_compressed(raw, compression, true);
+    bool ok = fp && (data.empty() || std::fwrite(data.c_str(), data.size(), 1, fp));
+    if (fp && std::fclose(fp) != 0)
+        ok = false;
+    if (ok)
+        data.assign(buf, size);
+    std::free(buf);
+    return ok;
+}
+
+#endif  // def RENUM_HAVE_COMPRESSION
+
+// open the input file decompressing it by the magic bytes
+FILE *RENUM_fopen_input(const std::string& filename)
+{
+    FILE *fin = fopen(filename.c_str(), "r");
+    if (!fin)
+        return nullptr;
+
+#ifndef RENUM_HAVE_COMPRESSION
+    // the stream that cannot be probed (a FIFO or stdin) is read as is
+    if (std::fseek(fin, 0, SEEK_CUR) != 0)
+        return fin;
+#endif
+
+    unsigned char magic[4];
+    size_t size = std::fread(magic, 1, sizeof(magic), fin);
+    auto compression = RENUM_compression_of_data(magic, size);
+    if (compression == RENUM_COMPRESSION_NONE && std::fseek(fin, 0, SEEK_SET) == 0)
+        return fin;
+
+#ifdef RENUM_HAVE_COMPRESSION
+    // the prefix is given back to the non-seekable file
+    if (FILE *fp = RENUM_open_compressed(fin, compression, false, magic, size))
+        return fp;
+#endif
+    std::fprintf(stderr, "renum: error: Unsupported compression of file '%s'\n", filename.c_str());
+    std::fclose(fin);
+    return nullptr;
+}
+
+// load a text file
+renum_error_t RENUM_load_file(const std::string& filename, std::string& text, bool& bom)
+{
+    text.clear();
+
+    FILE *fin = RENUM_fopen_input(filename);
+    if (!fin)
+    {
+        std::fprintf(stderr, "renum: error: Unable to open file '%s'\n", filename.c_str());
+        return 1;
+    }
+
+    char buf[512];
+    if (std::fgets(buf, sizeof(buf), fin))
+    {
+        if (std::memcmp(buf, UTF8_BOM, 3) == 0)
+        {
+            bom = true;
+            text += &buf[3];
+        }
+        else
+        {
+            text += buf;
+        }
+
+        while (std::fgets(buf, sizeof(buf), fin))
+        {
+            text += buf;
+        }
+    }
+
+    if (std::ferror(fin))
+    {
+        std::fprintf(stderr, "renum: error: Unable to read file '%s'\n", filename.c_str());
+        std::fclose(fin);
+        return 1;
+    }
+
+    // Cut '\x1A' and after
+    auto i0 = text.find('\x1A');
+    if (i0 != text.npos)
+        text.erase(i0);
+
+    std::fclose(fin);
+    return 0;
+}
+
+// write all the segments to the file
+bool RENUM_write_segments(FILE *fout, const RENUM_SEGMENT *segments, size_t count)
+{
+#ifndef _WIN32
+    if (fileno(fout) < 0) // compressed?
+#endif
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (segments[i].size && !std::fwrite(segments[i].data, segments[i].size, 1, fout))
+                return false;
+        }
+        return true;
+    }
+#ifndef _WIN32
+    // flush the buffer before the gathered I/O
+    if (std::fflush(fout) != 0)
+        return false;
+
+    int fd = fileno(fout);
+    std::vector<struct iovec> iov(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        iov[i].iov_base = const_cast<char *>(segments[i].data);
+        iov[i].iov_len = segments[i].size;
+    }
+
+    size_t i = 0;
+    while (i < count)
+    {
+        int cnt = int(std::min<size_t>(count - i, IOV_MAX));
+        ssize_t written = ::writev(fd, &iov[i], cnt);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        // skip the written segments
+        size_t size = size_t(written);
+        while (i < count && size >= iov[i].iov_len)
+        {
+            size -= iov[i].iov_len;
+            ++i;
+        }
+        if (i < count)
+        {
+            iov[i].iov_base = static_cast<char *>(iov[i].iov_base) + size;
+            iov[i].iov_len -= size;
+        }
+    }
+    return true;
+#endif
+}
+
+#ifndef _WIN32
+// is the output to be written in place? (a symbolic link, a device or a FIFO)
+bool RENUM_output_in_place(const std::string& filename)
+{
+    struct stat st;
+    return ::lstat(filename.c_str(), &st) == 0 && !S_ISREG(st.st_mode);
+}
+#endif
+
+// open the temporary file for the output in the same directory (compressed by the extension).
+// tmp_filename is empty if the output is written in place.
+FILE *RENUM_open_output(const std::string& filename, std::string& tmp_filename, bool compress = true)
+{
+    // unique among the threads
+    static std::atomic<unsigned> s_serial(0);
+    tmp_filename = filename + ".renum-tmp";
+#ifdef _WIN32
+    tmp_filename += std::to_string(_getpid()) + "-" + std::to_string(s_serial++);
+    FILE *fout = fopen(tmp_filename.c_str(), "w");
+#else
+    FILE *fout;
+    if (RENUM_output_in_place(filename))
+    {
+        tmp_filename.clear();
+        fout = fopen(filename.c_str(), "w");
+    }
+    else
+    {
+        tmp_filename += std::to_string(::getpid()) + "-" + std::to_string(s_serial++);
+        fout = fopen(tmp_filename.c_str(), "w");
+
+        // keep the permissions of the destination
+        struct stat st;
+        if (fout && ::stat(filename.c_str(), &st) == 0)
+            ::fchmod(fileno(fout), st.st_mode & 07777);
+    }
+#endif
+    if (!fout)
+    {
+        std::fprintf(stderr, "renum: error: Unable to open file '%s'\n", filename.c_str());
+        return nullptr;
+    }
+
+    auto compression = compress ? RENUM_compression_of_filename(filename) : RENUM_COMPRESSION_NONE;
+    if (compression != RENUM_COMPRESSION_NONE)
+    {
+#ifdef RENUM_HAVE_COMPRESSION
+        FILE *fp = RENUM_open_compressed(fout, compression, true);
+#else
+        FILE *fp = nullptr;
+        std::fclose(fout);
+#endif
+        if (!fp)
+        {
+            std::fprintf(stderr, "renum: error: Unsupported compression of file '%s'\n", filename.c_str());
+            std::remove(tmp_filename.c_str());
+        }
+        fout = fp;
+    }
+    return fout;
+}
+
+// close the temporary file of the output (removed on failure)
+renum_error_t
+RENUM_finish_output(FILE *fout, const std::string& filename, const std::string& tmp_filename, bool sync, bool ok)
+{
+    if (std::fflush(fout) != 0)
+        ok = false;
+#ifdef _WIN32
+    if (ok && sync)
+        ok = (_commit(_fileno(fout)) == 0);
+#else
+    // the pipes and the devices cannot be flushed (EINVAL)
+    int fd = fileno(fout);
+    if (ok && sync && fd >= 0)
+        ok = (::fsync(fd) == 0 || errno == EINVAL);
+#endif
+    if (std::fclose(fout) != 0)
+        ok = false;
+
+#ifndef _WIN32
+    // the compressed output is flushed after finishing the stream
+    if (ok && sync && fd < 0)
+    {
+        fd = ::open(tmp_filename.size() ? tmp_filename.c_str() : filename.c_str(), O_RDONLY);
+        ok = (fd >= 0 && (::fsync(fd) == 0 || errno == EINVAL));
+        if (fd >= 0)
+            ::close(fd);
+    }
+#endif
+
+    if (!ok)
+    {
+        std::fprintf(stderr, "renum: error: Unable to write file '%s'\n", filename.c_str());
+        if (tmp_filename.size())
+            std::remove(tmp_filename.c_str());
+        return 1;
+    }
+
+    return 0;
+}
+
+#ifndef _WIN32
+// flush the directory entry of the file to the storage
+bool RENUM_sync_parent_dir(const std::string& filename)
+{
+    auto ich = filename.rfind('/');
+    std::string dir = (ich == filename.npos) ? "." : filename.substr(0, ich ? ich : 1);
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return false;
+    bool ok = (::fsync(fd) == 0 || errno == EINVAL);
+    ::close(fd);
+    return ok;
+}
+#endif
+
+// replace the output with the closed temporary file (nothing to do if written in place)
+renum_error_t
+RENUM_replace_output(const std::string& filename, const std::string& tmp_filename, bool sync)
+{
+    if (tmp_filename.empty())
+        return 0;
+
+#ifdef _WIN32
+    DWORD dwFlags = MOVEFILE_REPLACE_EXISTING | (sync ? MOVEFILE_WRITE_THROUGH : 0);
+    bool ok = !!MoveFileExA(tmp_filename.c_str(), filename.c_str(), dwFlags);
+#else
+    bool ok = (::rename(tmp_filename.c_str(), filename.c_str()) == 0);
+
+    // the rename itself is durable after the directory is flushed
+    if (ok && sync && !RENUM_sync_parent_dir(filename))
+    {
+        std::fprintf(stderr, "renum: error: Unable to write file '%s'\n", filename.c_str());
+        return 1;
+    }
+#endif
+    if (!ok)
+    {
+        std::fprintf(stderr, "renum: error: Unable to write file '%s'\n", filename.c_str());
+        std::remove(tmp_filename.c_str());
+        return 1;
+    }
+
+    return 0;
+}
+
+// close the temporary file and replace the output with it
+renum_error_t
+RENUM_close_output(FILE *fout, const std::string& filename, const std::string& tmp_filename, bool sync, bool ok)
+{
+    if (RENUM_finish_output(fout, filename, tmp_filename, sync, ok))
+        return 1;
+    return RENUM_replace_output(filename, tmp_filename, sync);
+}
+
+// save the segments to a file atomically
+renum_error_t
+RENUM_save_segments(const std::string& filename, const RENUM_SEGMENT *segments, size_t count, bool sync)
+{
+    std::string tmp_filename;
+    FILE *fout = RENUM_open_output(filename, tmp_filename);
+    if (!fout)
+        return 1;
+
+    bool ok = RENUM_write_segments(fout, segments, count);
+    return RENUM_close_output(fout, filename, tmp_filename, sync, ok);
+}
+
+// save a text file
+renum_error_t RENUM_save_file(const std::string& filename, const std::string& text, bool bom, bool sync)
+{
+    RENUM_SEGMENT segments[2];
+    size_t count = 0;
+    if (bom)
+        segments[count++] = RENUM_SEGMENT { UTF8_BOM, 3 };
+    segments[count++] = RENUM_SEGMENT { text.c_str(), text.size() };
+    return RENUM_save_segments(filename, segments, count, sync);
+}
+
+// insert line numbers to each top of lines
+renum_error_t
+RENUM_add_split_line_numbers(
+    std::vector<std::string>& lines,
+    renum_lineno_t start,
+    renum_lineno_t step,
+    bool force)
+{
+    renum_lineno_t line_no = start;
+    size_t iLine = 1;
     for (auto& line : lines)
     {
         // trim the space of right side
@@ -408,9 +1353,11 @@ RENUM_add_line_numbers(
         auto number = RENUM_line_number_from_line_text(line);
         if (number > 0 && !force)
         {
-            RENUM_ERROR_MESSAGE("Line number already exists at " + std::to_string(number) + "\n");
+            RENUM_report_error("Line number already exists at " + std::to_string(number) + "\n",
+                               RENUM_ERR_LINE_NUMBER_EXISTS, iLine, number);
             return 1;
         }
+        ++iLine;
 
         // add it to the left side
         line = std::to_string(line_no) + " " + line;
@@ -419,33 +1366,48 @@ RENUM_add_line_numbers(
         line_no += step;
     }
 
-    // join the lines
-    text = std::move(mstr_join(lines, "\n"));
-#ifdef RENUM_APPEND_NEWLINE
-    text += '\n';
-#endif
-
     return 0;
 }
 
-// renumber a line
-bool
-RENUM_renumber_one_line(
-    const VskLineNoMap& old_to_new_line,
-    std::string& line,
-    renum_lineno_t old_line_no,
-    bool force = false)
+// insert line numbers to the text
+renum_error_t
+RENUM_add_line_numbers(
+    std::string& text,
+    renum_lineno_t start,
+    renum_lineno_t step,
+    bool force)
 {
-    auto it0 = old_to_new_line.find(old_line_no);
-    if (it0 == old_to_new_line.end())
-        return force;
-    auto new_line_no = it0->second;
+    // trim the space of right side
+    mstr_trim_right(text, " \t\r\n");
 
-    RENUM_Tokenizer tokenizer(line);
+    // split to lines
+    std::vector<std::string> lines;
+    mstr_split(lines, text, "\n");
+
+    if (RENUM_add_split_line_numbers(lines, start, step, force))
+        return 1;
+
+    // join the lines
+    RENUM_join_lines(text, lines);
 
+    return 0;
+}
+
+// scan the line numbers referred in a line
+template <typename T_FN>
+bool RENUM_scan_line_numbers(RENUM_Tokenizer& tokenizer, T_FN fn)
+{
     // scan the lien string
     bool went = false, range = false, expect_lineno = false, comment = false, gosub_goto = false;
     bool expect_label = false;
+
+    // most lines have no keyword to refer to line numbers
+    if (!RENUM_may_refer_line_numbers(tokenizer.m_str.c_str() + tokenizer.m_ich,
+                                      tokenizer.m_str.size() - std::min(tokenizer.m_ich, tokenizer.m_str.size())))
+    {
+        return true;
+    }
+
     while (!tokenizer.is_eof() && !comment)
     {
         auto word = tokenizer.get_next_word();
@@ -455,18 +1417,8 @@ RENUM_renumber_one_line(
             auto number = RENUM_line_number_from_line_text(word);
             if (number > 0) // line number?
             {
-                auto it = old_to_new_line.find(number);
-                if (it == old_to_new_line.end()) // not found?
-                {
-                    RENUM_ERROR_MESSAGE("Undefined line " + std::to_string(number) + " in " + std::to_string(old_line_no) + "\n");
-                    if (!force)
-                        return false;
-                }
-                else
-                {
-                    // replace line number text
-                    tokenizer.replace_word(std::to_string(it->second));
-                }
+                if (!fn(tokenizer, word, number))
+                    return false;
             }
         }
 
@@ -537,26 +1489,90 @@ RENUM_renumber_one_line(
         }
     }
 
-    // insert new line number
-    line = std::to_string(new_line_no) + " " + line;
     return true;
 }
 
-renum_error_t
-RENUM_renumber_lines(
-    std::string& text,
-    renum_lineno_t new_start,
-    renum_lineno_t old_start,
-    renum_lineno_t step,
-    bool force)
+// renumber a line
+bool
+RENUM_renumber_one_line(
+    const VskLineNoMap& old_to_new_line,
+    std::string& line,
+    renum_lineno_t old_line_no,
+    bool force = false)
 {
-    // trim the space of right side
-    mstr_trim_right(text, " \t\r\n");
+    auto it0 = old_to_new_line.find(old_line_no);
+    if (it0 == old_to_new_line.end())
+        return force;
+    auto new_line_no = it0->second;
 
-    // split to lines
-    std::vector<std::string> lines;
-    mstr_split(lines, text, "\n");
+    RENUM_Tokenizer tokenizer(line);
+    bool ok = RENUM_scan_line_numbers(tokenizer,
+        [&](RENUM_Tokenizer& tokenizer, const std::string&, renum_lineno_t number)
+        {
+            auto it = old_to_new_line.find(number);
+            if (it == old_to_new_line.end()) // not found?
+            {
+                RENUM_report_error("Undefined line " + std::to_string(number) + " in " + std::to_string(old_line_no) + "\n",
+                                   RENUM_ERR_UNDEFINED_LINE, 0, old_line_no, number, tokenizer.m_ich + 1);
+                return force;
+            }
+
+            // replace line number text
+            tokenizer.replace_word(std::to_string(it->second));
+            return true;
+        }
+    );
+    if (!ok)
+        return false;
+
+    // insert new line number
+    line = std::to_string(new_line_no) + " " + line;
+    return true;
+}
+
+// renumber lines by the mapping
+bool
+RENUM_renumber_lines_by_map(
+    const VskLineNoMap& old_to_new_line,
+    std::vector<std::string>& lines,
+    bool force)
+{
+    for (size_t iLine = 0; iLine < lines.size(); ++iLine)
+    {
+        auto& line = lines[iLine];
+        if (line.empty())
+            continue;
+
+        // get line number and remove it
+        char *endptr;
+        auto old_line_no = RENUM_line_number_from_line_text(line, &endptr);
+        size_t prefix = endptr - &line[0];
+        line = endptr;
+
+        // renumber one line and add the line number
+        if (!RENUM_renumber_one_line(old_to_new_line, line, old_line_no, force))
+        {
+            // the column in the line having the line number
+            if (s_renum_error.column)
+                s_renum_error.column += prefix;
+            if (!s_renum_error.line)
+                s_renum_error.line = iLine + 1;
+            return false;
+        }
+    }
+
+    return true;
+}
 
+// renumber the lines split from the text
+renum_error_t
+RENUM_renumber_split_lines(
+    std::vector<std::string>& lines,
+    renum_lineno_t new_start,
+    renum_lineno_t old_start,
+    renum_lineno_t step,
+    bool force)
+{
     // create a mapping from old line to new line
     VskLineNoMap old_to_new_line;
     renum_lineno_t new_line_no = new_start;
@@ -572,7 +1588,8 @@ RENUM_renumber_lines(
         {
             if (!force)
             {
-                RENUM_ERROR_MESSAGE("No line number found at line " + std::to_string(iLine) + "\n");
+                RENUM_report_error("No line number found at line " + std::to_string(iLine) + "\n",
+                                   RENUM_ERR_NO_LINE_NUMBER, iLine);
                 return 1;
             }
         }
@@ -592,66 +1609,3851 @@ RENUM_renumber_lines(
 
         ++iLine;
     }
+    RENUM_emit_line_map(old_to_new_line);
 
     // renumber lines
-    for (auto& line : lines)
+    if (!RENUM_renumber_lines_by_map(old_to_new_line, lines, force))
+        return 1;
+
+    return 0;
+}
+
+renum_error_t
+RENUM_renumber_lines(
+    std::string& text,
+    renum_lineno_t new_start,
+    renum_lineno_t old_start,
+    renum_lineno_t step,
+    bool force)
+{
+    // trim the space of right side
+    mstr_trim_right(text, " \t\r\n");
+
+    // split to lines
+    std::vector<std::string> lines;
+    mstr_split(lines, text, "\n");
+
+    if (RENUM_renumber_split_lines(lines, new_start, old_start, step, force))
+        return 1;
+
+    // join the lines
+    RENUM_join_lines(text, lines);
+
+    return 0;
+}
+
+// call the function for each index in parallel
+template <typename T_FN>
+void RENUM_parallel_for(size_t count, T_FN fn)
+{
+    size_t cThreads = std::min<size_t>(std::max(1U, std::thread::hardware_concurrency()), count);
+    if (cThreads <= 1)
     {
-        // get line number and remove it
-        char *endptr;
-        auto old_line_no = RENUM_line_number_from_line_text(line, &endptr);
-        line = endptr;
+        for (size_t i = 0; i < count; ++i)
+            fn(i);
+        return;
+    }
 
-        // renumber one line and add the line number
-        if (!RENUM_renumber_one_line(old_to_new_line, line, old_line_no, force))
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    auto encoding = RENUM_get_encoding();
+    bool quiet = s_renum_quiet;
+    for (size_t iThread = 0; iThread < cThreads; ++iThread)
+    {
+        threads.emplace_back([&]() {
+            RENUM_set_encoding(encoding);
+            s_renum_quiet = quiet;
+            for (size_t i; (i = next++) < count; )
+                fn(i);
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+}
+
+// set the error of the first failed task to the calling thread
+renum_error_t
+RENUM_raise_first_error(const std::vector<renum_error_t>& errors, const std::vector<RENUM_ERROR_INFO>& infos)
+{
+    for (size_t i = 0; i < errors.size(); ++i)
+    {
+        if (errors[i])
         {
-            return 1;
+            s_renum_error = infos[i];
+            return errors[i];
+        }
+    }
+    return 0;
+}
+
+// renumber the files sharing one line number space
+renum_error_t
+RENUM_renumber_project(
+    std::vector<RENUM_PROJECT_FILE>& files,
+    renum_lineno_t new_start,
+    renum_lineno_t old_start,
+    renum_lineno_t step,
+    bool force)
+{
+    // index the files
+    std::vector<std::vector<std::string>> file_lines(files.size());
+    std::vector<std::vector<renum_lineno_t>> file_numbers(files.size());
+    std::vector<renum_error_t> errors(files.size());
+    std::vector<RENUM_ERROR_INFO> infos(files.size());
+    RENUM_parallel_for(files.size(), [&](size_t iFile) {
+        auto& text = files[iFile].text;
+        RENUM_sort_by_line_numbers(text);
+
+        // trim the space of right side
+        mstr_trim_right(text, " \t\r\n");
+
+        // split to lines
+        auto& lines = file_lines[iFile];
+        mstr_split(lines, text, "\n");
+
+        size_t iLine = 1;
+        for (auto& line : lines)
+        {
+            // trim the space of right side
+            mstr_trim_right(line, " \t\r\n");
+
+            auto old_line_no = RENUM_line_number_from_line_text(line);
+            if (old_line_no > 0)
+            {
+                file_numbers[iFile].push_back(old_line_no);
+            }
+            else if (!force) // No line number?
+            {
+                RENUM_report_error("No line number found at line " + std::to_string(iLine) +
+                                   " in " + files[iFile].filename + "\n",
+                                   RENUM_ERR_NO_LINE_NUMBER, iLine);
+                errors[iFile] = 1;
+                infos[iFile] = s_renum_error;
+                return;
+            }
+            ++iLine;
         }
+    });
+    if (renum_error_t error = RENUM_raise_first_error(errors, infos))
+        return error;
+
+    // merge the line numbers of all the files
+    std::vector<std::pair<renum_lineno_t, size_t>> numbers;
+    for (size_t iFile = 0; iFile < files.size(); ++iFile)
+    {
+        for (auto& number : file_numbers[iFile])
+            numbers.push_back(std::make_pair(number, iFile));
     }
+    std::stable_sort(numbers.begin(), numbers.end(),
+        [](const std::pair<renum_lineno_t, size_t>& a, const std::pair<renum_lineno_t, size_t>& b) {
+            return a.first < b.first;
+        }
+    );
 
-    // join the lines
-    text = std::move(mstr_join(lines, "\n"));
-#ifdef RENUM_APPEND_NEWLINE
-    text += '\n';
-#endif
+    // create the global mapping from old line to new line
+    VskLineNoMap old_to_new_line;
+    renum_lineno_t new_line_no = new_start;
+    for (size_t i = 0; i < numbers.size(); ++i)
+    {
+        auto old_line_no = numbers[i].first;
+        if (i > 0 && numbers[i - 1].first == old_line_no)
+        {
+            if (numbers[i - 1].second != numbers[i].second)
+            {
+                RENUM_report_error("Duplicated line " + std::to_string(old_line_no) + " in " +
+                                   files[numbers[i - 1].second].filename + " and " +
+                                   files[numbers[i].second].filename + "\n",
+                                   RENUM_ERR_DUPLICATED_LINE, 0, old_line_no);
+                if (!force)
+                    return 1;
+            }
+        }
+
+        if (old_line_no >= old_start)
+        {
+            // update the mapping
+            old_to_new_line[old_line_no] = new_line_no;
+
+            // step up
+            new_line_no += step;
+        }
+        else
+        {
+            // update the mapping
+            old_to_new_line[old_line_no] = old_line_no;
+        }
+    }
+
+    // renumber the files (the workers share the mapping read-only)
+    const VskLineNoMap& mapping = old_to_new_line;
+    RENUM_parallel_for(files.size(), [&](size_t iFile) {
+        auto& file = files[iFile];
+        auto& lines = file_lines[iFile];
+        if (!RENUM_renumber_lines_by_map(mapping, lines, force))
+        {
+            errors[iFile] = 1;
+            infos[iFile] = s_renum_error;
+            return;
+        }
+
+        // the range of the new line numbers
+        file.first = file.last = 0;
+        if (file_numbers[iFile].size())
+        {
+            file.first = mapping.find(file_numbers[iFile].front())->second;
+            file.last = mapping.find(file_numbers[iFile].back())->second;
+        }
+
+        // join the lines
+        RENUM_join_lines(file.text, lines);
+    });
+    if (renum_error_t error = RENUM_raise_first_error(errors, infos))
+        return error;
 
     return 0;
 }
 
-#ifdef RENUM_EXE
+// read a line without the newline
+bool RENUM_read_line(FILE *fin, std::string& line)
+{
+    line.clear();
 
-// parse command line
-renum_error_t RENUM_parse_cmdline(RENUM& renum, int argc, char **argv)
+    char buf[512];
+    while (std::fgets(buf, sizeof(buf), fin))
+    {
+        size_t len = std::strlen(buf);
+        if (len && buf[len - 1] == '\n')
+        {
+            line.append(buf, len - 1);
+            return true;
+        }
+        line.append(buf, len);
+    }
+
+    return !line.empty();
+}
+
+// a sorted run of lines for the external merge sort
+struct RENUM_RUN
 {
-    renum.m_options.clear();
-    renum.m_options["-o"] = RENUM_DEFAULT_OUTPUT;
+    FILE *m_fp = nullptr;               // the spilled run
+    std::vector<std::string> m_lines;   // the run in memory
+    size_t m_iLine = 0;
+    std::string m_line;
+    renum_lineno_t m_number = 0;
+    size_t m_level = 0;                 // the number of the merges into this run
 
-    for (int iarg = 1; iarg < argc; ++iarg)
+    ~RENUM_RUN()
     {
-        std::string arg = argv[iarg];
-        if (arg == "--help" || arg == "/?")
+        if (m_fp)
+            std::fclose(m_fp);
+    }
+
+    // sort the lines by line numbers
+    void sort()
+    {
+        std::stable_sort(m_lines.begin(), m_lines.end(), [](const std::string& line0, const std::string& line1){
+            auto number0 = RENUM_line_number_from_line_text(line0);
+            auto number1 = RENUM_line_number_from_line_text(line1);
+            return number0 < number1;
+        });
+    }
+
+    // write the lines to a temporary file
+    bool spill()
+    {
+        m_fp = std::tmpfile();
+        if (!m_fp)
+            return false;
+        for (auto& line : m_lines)
+        {
+            if (std::fputs(line.c_str(), m_fp) < 0 || std::fputc('\n', m_fp) < 0)
+                return false;
+        }
+        m_lines.clear();
+        m_lines.shrink_to_fit();
+        return std::fflush(m_fp) == 0 && std::fseek(m_fp, 0, SEEK_SET) == 0;
+    }
+
+    // get the next line
+    bool next()
+    {
+        if (m_fp)
+        {
+            if (!RENUM_read_line(m_fp, m_line))
+                return false;
+        }
+        else
+        {
+            if (m_iLine >= m_lines.size())
+                return false;
+            m_line = std::move(m_lines[m_iLine++]);
+        }
+        m_number = RENUM_line_number_from_line_text(m_line);
+        return true;
+    }
+};
+
+// detect the encoding line by line as RENUM_detect_encoding does for the whole text
+struct RENUM_ENCODING_SCANNER
+{
+    bool m_non_ascii = false;
+    bool m_utf8 = true;
+
+    void scan(const std::string& line)
+    {
+        for (char ch : line)
+        {
+            if (ch & 0x80)
+            {
+                // the terminating null ends a truncated sequence as a newline does
+                m_non_ascii = true;
+                if (m_utf8)
+                    m_utf8 = vsk_is_utf8(line.c_str(), line.size() + 1);
+                break;
+            }
+        }
+    }
+
+    RENUM_ENCODING encoding(bool bom) const
+    {
+        if (bom || (m_non_ascii && m_utf8))
+            return RENUM_ENCODING_UTF8;
+        return m_non_ascii ? RENUM_ENCODING_SJIS : RENUM_ENCODING_ASCII;
+    }
+};
+
+// read the lines of a program file for the streaming paths
+struct RENUM_LINE_READER
+{
+    FILE *m_fin;
+    bool m_force;
+    bool m_scan_encoding = false;   // scan the encoding over the whole input?
+    RENUM_ENCODING_SCANNER m_scanner;
+    bool m_bom = false;
+    bool m_eof = false;
+    bool m_error = false;
+    size_t m_iLine = 0;         // the physical line index
+    size_t m_cBlankLines = 0;   // the blank lines before m_next
+    std::string m_next;
+    bool m_has_next = false;
+
+    RENUM_LINE_READER(FILE *fin, bool force) : m_fin(fin), m_force(force)
+    {
+    }
+
+    // get the next line trimmed (the blank lines at the end are skipped)
+    bool next(std::string& line, renum_lineno_t& number)
+    {
+        while (!m_has_next)
+        {
+            if (m_eof)
+                return false;
+            if (!RENUM_read_line(m_fin, m_next))
+            {
+                // the broken compressed file etc.
+                if (std::ferror(m_fin))
+                {
+                    std::fprintf(stderr, "renum: error: Unable to read the input file\n");
+                    m_error = true;
+                }
+                return false;
+            }
+
+            ++m_iLine;
+            if (m_iLine == 1 && std::memcmp(m_next.c_str(), UTF8_BOM, 3) == 0)
+            {
+                m_bom = true;
+                m_next.erase(0, 3);
+            }
+
+            // Cut '\x1A' and after
+            auto i0 = m_next.find('\x1A');
+            if (i0 != m_next.npos)
+            {
+                m_next.erase(i0);
+                m_eof = true;
+            }
+
+            // trim the space of right side
+            mstr_trim_right(m_next, " \t\r\n");
+
+            if (m_scan_encoding)
+                m_scanner.scan(m_next);
+
+            if (m_next.empty())
+                ++m_cBlankLines;
+            else
+                m_has_next = true;
+        }
+
+        // the blank lines in the middle
+        if (m_cBlankLines)
+        {
+            if (!m_force)
+            {
+                RENUM_report_error("No line number found at line " + std::to_string(m_iLine - m_cBlankLines) + "\n",
+                                   RENUM_ERR_NO_LINE_NUMBER, m_iLine - m_cBlankLines);
+                m_error = true;
+                return false;
+            }
+            --m_cBlankLines;
+            line.clear();
+            number = 0;
+            return true;
+        }
+
+        m_has_next = false;
+        line = std::move(m_next);
+        number = RENUM_line_number_from_line_text(line);
+        if (number <= 0 && !m_force) // No line number?
+        {
+            RENUM_report_error("No line number found at line " + std::to_string(m_iLine) + "\n",
+                               RENUM_ERR_NO_LINE_NUMBER, m_iLine);
+            m_error = true;
+            return false;
+        }
+        return true;
+    }
+};
+
+// create a mapping from old line to new line by the counts of the line numbers
+void
+RENUM_map_line_numbers(
+    VskLineNoMap& old_to_new_line,
+    const std::map<renum_lineno_t, size_t>& counts,
+    renum_lineno_t new_start,
+    renum_lineno_t old_start,
+    renum_lineno_t step)
+{
+    old_to_new_line.clear();
+    renum_lineno_t new_line_no = new_start;
+    for (auto& pair : counts)
+    {
+        auto old_line_no = pair.first;
+        if (old_line_no >= old_start)
+        {
+            // update the mapping (the last one of the duplicated lines wins)
+            old_to_new_line[old_line_no] = new_line_no + (pair.second - 1) * step;
+
+            // step up
+            new_line_no += pair.second * step;
+        }
+        else
+        {
+            // update the mapping
+            old_to_new_line[old_line_no] = old_line_no;
+        }
+    }
+}
+
+// renumber a line having the line number
+bool RENUM_renumber_line_text(const VskLineNoMap& old_to_new_line, std::string& line, bool force)
+{
+    if (line.empty())
+        return true;
+
+    // get line number and remove it
+    char *endptr;
+    auto old_line_no = RENUM_line_number_from_line_text(line, &endptr);
+    line = endptr;
+
+    // renumber one line and add the line number
+    return RENUM_renumber_one_line(old_to_new_line, line, old_line_no, force);
+}
+
+#define RENUM_MERGE_FAN_IN 64
+
+// merge the runs from iFirst by line number (the earlier run first if the same)
+template <typename T_FN>
+bool RENUM_merge_runs(std::vector<std::unique_ptr<RENUM_RUN>>& runs, size_t iFirst, T_FN fn)
+{
+    auto greater = [&](size_t iRun0, size_t iRun1) {
+        if (runs[iRun0]->m_number != runs[iRun1]->m_number)
+            return runs[iRun0]->m_number > runs[iRun1]->m_number;
+        return iRun0 > iRun1;
+    };
+    std::vector<size_t> heap;
+    for (size_t iRun = iFirst; iRun < runs.size(); ++iRun)
+    {
+        if (runs[iRun]->next())
+            heap.push_back(iRun);
+    }
+    std::make_heap(heap.begin(), heap.end(), greater);
+
+    std::string line;
+    while (heap.size())
+    {
+        std::pop_heap(heap.begin(), heap.end(), greater);
+        auto& run = *runs[heap.back()];
+        line = std::move(run.m_line);
+        if (run.next())
+            std::push_heap(heap.begin(), heap.end(), greater);
+        else
+            heap.pop_back();
+
+        if (!fn(line))
+            return false;
+    }
+    return true;
+}
+
+// merge the runs from iFirst into one spilled run
+bool RENUM_merge_last_runs(std::vector<std::unique_ptr<RENUM_RUN>>& runs, size_t iFirst)
+{
+    std::unique_ptr<RENUM_RUN> merged(new RENUM_RUN);
+    merged->m_level = runs.back()->m_level + 1;
+    merged->m_fp = std::tmpfile();
+    if (!merged->m_fp)
+        return false;
+
+    FILE *fp = merged->m_fp;
+    bool ok = RENUM_merge_runs(runs, iFirst, [fp](const std::string& line) {
+        return std::fputs(line.c_str(), fp) >= 0 && std::fputc('\n', fp) != EOF;
+    });
+    runs.resize(iFirst);
+    runs.push_back(std::move(merged));
+    return ok && std::fflush(fp) == 0 && std::fseek(fp, 0, SEEK_SET) == 0;
+}
+
+// renumber lines of a file with bounded memory, merging fan_in runs at most at once
+renum_error_t
+RENUM_renumber_file_by_runs(
+    const std::string& in_filename,
+    const std::string& out_filename,
+    size_t memory_budget,
+    size_t fan_in,
+    renum_lineno_t new_start,
+    renum_lineno_t old_start,
+    renum_lineno_t step,
+    bool force,
+    bool sync,
+    bool auto_encoding)
+{
+    FILE *fin = RENUM_fopen_input(in_filename);
+    if (!fin)
+    {
+        std::fprintf(stderr, "renum: error: Unable to open file '%s'\n", in_filename.c_str());
+        return 1;
+    }
+
+    // produce the sorted runs and count the line numbers
+    std::vector<std::unique_ptr<RENUM_RUN>> runs;
+    std::map<renum_lineno_t, size_t> counts;
+    std::unique_ptr<RENUM_RUN> run(new RENUM_RUN);
+    RENUM_LINE_READER reader(fin, force);
+    reader.m_scan_encoding = auto_encoding;
+    std::string line;
+    renum_lineno_t old_line_no;
+    size_t run_size = 0;
+    while (reader.next(line, old_line_no))
+    {
+        if (old_line_no > 0)
+            ++counts[old_line_no];
+
+        // spill the run if it is full
+        run_size += line.size() + sizeof(std::string);
+        run->m_lines.push_back(std::move(line));
+        if (run_size >= memory_budget)
+        {
+            run->sort();
+            bool ok = run->spill();
+            runs.push_back(std::move(run));
+            run.reset(new RENUM_RUN);
+            run_size = 0;
+
+            // the runs of the same level are merged to keep the temporary files fewer than fan_in per level
+            while (ok && runs.size() >= fan_in &&
+                   runs[runs.size() - fan_in]->m_level == runs.back()->m_level)
+            {
+                ok = RENUM_merge_last_runs(runs, runs.size() - fan_in);
+            }
+            if (!ok)
+            {
+                std::fprintf(stderr, "renum: error: Unable to write temporary file\n");
+                std::fclose(fin);
+                return 1;
+            }
+        }
+    }
+    std::fclose(fin);
+    if (reader.m_error)
+        return 1;
+    if (auto_encoding)
+        RENUM_set_encoding(reader.m_scanner.encoding(reader.m_bom));
+
+    // the last run stays in memory
+    run->sort();
+    runs.push_back(std::move(run));
+
+    // the smallest runs are merged until the final merge takes all of them
+    while (runs.size() > fan_in)
+    {
+        if (!RENUM_merge_last_runs(runs, runs.size() - fan_in))
+        {
+            std::fprintf(stderr, "renum: error: Unable to write temporary file\n");
+            return 1;
+        }
+    }
+
+    // create a mapping from old line to new line
+    VskLineNoMap old_to_new_line;
+    RENUM_map_line_numbers(old_to_new_line, counts, new_start, old_start, step);
+    RENUM_emit_line_map(old_to_new_line);
+
+    std::string tmp_filename;
+    FILE *fout = RENUM_open_output(out_filename, tmp_filename);
+    if (!fout)
+        return 1;
+
+    bool ok = true;
+    if (reader.m_bom)
+        ok = (std::fwrite(UTF8_BOM, 3, 1, fout) == 1);
+
+    // k-way merge of the runs by line number
+    bool first = true, renumbered = true;
+    if (ok)
+    {
+        ok = RENUM_merge_runs(runs, 0, [&](std::string& line) {
+            if (!RENUM_renumber_line_text(old_to_new_line, line, force))
+            {
+                renumbered = false;
+                return false;
+            }
+
+            if (!first && std::fputc('\n', fout) == EOF)
+                return false;
+            first = false;
+            return std::fputs(line.c_str(), fout) >= 0;
+        });
+    }
+    if (!renumbered)
+    {
+        std::fclose(fout);
+        std::remove(tmp_filename.c_str());
+        return 1;
+    }
+#ifdef RENUM_APPEND_NEWLINE
+    if (ok && !first)
+        ok = (std::fputc('\n', fout) != EOF);
+#endif
+
+    return RENUM_close_output(fout, out_filename, tmp_filename, sync, ok);
+}
+
+// renumber lines of a file with bounded memory
+renum_error_t
+RENUM_renumber_file(
+    const std::string& in_filename,
+    const std::string& out_filename,
+    size_t memory_budget,
+    renum_lineno_t new_start,
+    renum_lineno_t old_start,
+    renum_lineno_t step,
+    bool force,
+    bool sync,
+    bool auto_encoding)
+{
+    return RENUM_renumber_file_by_runs(in_filename, out_filename, memory_budget, RENUM_MERGE_FAN_IN,
+                                       new_start, old_start, step, force, sync, auto_encoding);
+}
+
+#define RENUM_RING_SPINS 256
+
+// a bounded lock-free queue of a single producer and a single consumer
+// (the blocking side spins briefly and then sleeps until the other side moves)
+template <typename T, size_t t_size>
+struct RENUM_RING
+{
+    T m_items[t_size];
+    std::atomic<size_t> m_head, m_tail;
+    std::atomic<int> m_waiters;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+
+    RENUM_RING() : m_head(0), m_tail(0), m_waiters(0)
+    {
+    }
+
+    bool try_push(T item)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) == t_size)
+            return false;
+        m_items[tail % t_size] = item;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& item)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire))
+            return false;
+        item = m_items[head % t_size];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    void push(T item)
+    {
+        wait([&]() { return try_push(item); });
+        wake();
+    }
+
+    T pop()
+    {
+        T item;
+        wait([&]() { return try_pop(item); });
+        wake();
+        return item;
+    }
+
+    // wake the other side if sleeping
+    void wake()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_waiters.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_cv.notify_all();
+        }
+    }
+
+    template <typename T_FN>
+    void wait(T_FN fn)
+    {
+        for (int i = 0; i < RENUM_RING_SPINS; ++i)
+        {
+            if (fn())
+                return;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_waiters.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        m_cv.wait(lock, fn);
+        m_waiters.fetch_sub(1);
+    }
+};
+
+#define RENUM_BATCH_LINES 1024
+#define RENUM_RING_SIZE 16
+
+typedef std::vector<std::string> RENUM_BATCH;
+
+// renumber lines of a file by the pipelined stages
+renum_error_t
+RENUM_renumber_file_pipelined(
+    const std::string& in_filename,
+    const std::string& out_filename,
+    size_t jobs,
+    renum_lineno_t new_start,
+    renum_lineno_t old_start,
+    renum_lineno_t step,
+    bool force,
+    bool sync,
+    bool auto_encoding)
+{
+    FILE *fin = RENUM_fopen_input(in_filename);
+    if (!fin)
+    {
+        std::fprintf(stderr, "renum: error: Unable to open file '%s'\n", in_filename.c_str());
+        return 1;
+    }
+
+    // the reader stage
+    RENUM_LINE_READER reader(fin, force);
+    reader.m_scan_encoding = auto_encoding;
+    RENUM_RING<RENUM_BATCH *, RENUM_RING_SIZE> read_ring;
+    std::thread reader_thread([&]() {
+        std::unique_ptr<RENUM_BATCH> batch(new RENUM_BATCH);
+        std::string line;
+        renum_lineno_t old_line_no;
+        while (reader.next(line, old_line_no))
+        {
+            batch->push_back(std::move(line));
+            if (batch->size() >= RENUM_BATCH_LINES)
+            {
+                read_ring.push(batch.release());
+                batch.reset(new RENUM_BATCH);
+            }
+        }
+        if (batch->size())
+            read_ring.push(batch.release());
+        read_ring.push(nullptr);
+    });
+
+    // index the batches while reading
+    std::vector<std::unique_ptr<RENUM_BATCH>> batches;
+    std::map<renum_lineno_t, size_t> counts;
+    renum_lineno_t prev_line_no = 0;
+    bool sorted = true;
+    while (RENUM_BATCH *batch = read_ring.pop())
+    {
+        batches.emplace_back(batch);
+        for (auto& line : *batch)
+        {
+            auto old_line_no = RENUM_line_number_from_line_text(line);
+            if (old_line_no < prev_line_no)
+                sorted = false;
+            prev_line_no = old_line_no;
+            if (old_line_no > 0)
+                ++counts[old_line_no];
+        }
+    }
+    reader_thread.join();
+    std::fclose(fin);
+    if (reader.m_error)
+        return 1;
+    if (auto_encoding)
+        RENUM_set_encoding(reader.m_scanner.encoding(reader.m_bom));
+
+    // sort the lines if necessary
+    if (!sorted)
+    {
+        RENUM_RUN run;
+        for (auto& batch : batches)
+        {
+            for (auto& line : *batch)
+                run.m_lines.push_back(std::move(line));
+        }
+        run.sort();
+
+        batches.clear();
+        for (size_t i = 0; i < run.m_lines.size(); i += RENUM_BATCH_LINES)
+        {
+            size_t count = std::min<size_t>(RENUM_BATCH_LINES, run.m_lines.size() - i);
+            batches.emplace_back(new RENUM_BATCH(std::make_move_iterator(run.m_lines.begin() + i),
+                                                 std::make_move_iterator(run.m_lines.begin() + i + count)));
+        }
+    }
+
+    // create a mapping from old line to new line
+    VskLineNoMap old_to_new_line;
+    RENUM_map_line_numbers(old_to_new_line, counts, new_start, old_start, step);
+    RENUM_emit_line_map(old_to_new_line);
+
+    std::string tmp_filename;
+    FILE *fout = RENUM_open_output(out_filename, tmp_filename);
+    if (!fout)
+        return 1;
+
+    // the rewriter stage (the batches are assigned round-robin to keep the order)
+    jobs = std::max<size_t>(jobs, 1);
+    std::vector<std::unique_ptr<RENUM_RING<RENUM_BATCH *, RENUM_RING_SIZE>>> in_rings, out_rings;
+    std::vector<std::thread> workers;
+    std::atomic<bool> failed(false);
+    for (size_t iJob = 0; iJob < jobs; ++iJob)
+    {
+        in_rings.emplace_back(new RENUM_RING<RENUM_BATCH *, RENUM_RING_SIZE>);
+        out_rings.emplace_back(new RENUM_RING<RENUM_BATCH *, RENUM_RING_SIZE>);
+    }
+    auto encoding = RENUM_get_encoding();
+    for (size_t iJob = 0; iJob < jobs; ++iJob)
+    {
+        workers.emplace_back([&, iJob]() {
+            RENUM_set_encoding(encoding);
+            while (RENUM_BATCH *batch = in_rings[iJob]->pop())
+            {
+                if (!failed)
+                {
+                    for (auto& line : *batch)
+                    {
+                        if (!RENUM_renumber_line_text(old_to_new_line, line, force))
+                        {
+                            failed = true;
+                            break;
+                        }
+                    }
+                }
+                out_rings[iJob]->push(batch);
+            }
+        });
+    }
+
+    // the writer stage
+    bool ok = true;
+    std::thread writer_thread([&]() {
+        std::vector<RENUM_SEGMENT> segments;
+        if (reader.m_bom)
+            segments.push_back(RENUM_SEGMENT { UTF8_BOM, 3 });
+        bool first = true;
+        for (size_t iBatch = 0; iBatch < batches.size(); ++iBatch)
+        {
+            RENUM_BATCH *batch = out_rings[iBatch % jobs]->pop();
+            if (!ok || failed)
+                continue;
+
+            for (auto& line : *batch)
+            {
+                if (!first)
+                    segments.push_back(RENUM_SEGMENT { "\n", 1 });
+                first = false;
+                segments.push_back(RENUM_SEGMENT { line.c_str(), line.size() });
+            }
+#ifdef RENUM_APPEND_NEWLINE
+            if (iBatch + 1 == batches.size())
+                segments.push_back(RENUM_SEGMENT { "\n", 1 });
+#endif
+            ok = RENUM_write_segments(fout, segments.data(), segments.size());
+            segments.clear();
+
+            // release the written lines
+            RENUM_BATCH().swap(*batch);
+        }
+    });
+
+    // dispatch the batches
+    for (size_t iBatch = 0; iBatch < batches.size(); ++iBatch)
+        in_rings[iBatch % jobs]->push(batches[iBatch].get());
+    for (size_t iJob = 0; iJob < jobs; ++iJob)
+        in_rings[iJob]->push(nullptr);
+
+    for (auto& worker : workers)
+        worker.join();
+    writer_thread.join();
+
+    if (failed)
+    {
+        std::fclose(fout);
+        std::remove(tmp_filename.c_str());
+        return 1;
+    }
+
+    return RENUM_close_output(fout, out_filename, tmp_filename, sync, ok);
+}
+
+// renumber a program text in the usual way
+renum_error_t
+RENUM_renumber_text(
+    std::string& text,
+    renum_lineno_t new_start,
+    renum_lineno_t old_start,
+    renum_lineno_t step,
+    bool force)
+{
+    renum_lineno_t first_lineno = RENUM_line_number_from_line_text(text, nullptr);
+    if (first_lineno == 0)
+        return RENUM_add_line_numbers(text, new_start, step);
+
+    RENUM_sort_by_line_numbers(text);
+    return RENUM_renumber_lines(text, new_start, old_start, step, force);
+}
+
+// the state of a batch item in the I/O engines
+struct RENUM_BATCH_STATE
+{
+    RENUM_BATCH_ITEM *m_item;
+    std::string m_text;
+    bool m_bom = false;
+    bool m_compressed = false;  // to be loaded by the worker
+    int m_fd = -1;
+    size_t m_done = 0;      // the bytes read or written
+    int m_stage = 0;
+    std::string m_tmp_filename;
+    int m_mode = -1;        // the permissions of the destination (-1 if none)
+};
+
+// the queue of the renumbering workers
+struct RENUM_BATCH_QUEUE
+{
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<RENUM_BATCH_STATE *> m_states;
+    bool m_closed = false;
+
+    void push(RENUM_BATCH_STATE *state)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_states.push_back(state);
+        }
+        m_cv.notify_one();
+    }
+
+    // returns nullptr if closed
+    RENUM_BATCH_STATE *pop()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [&]() { return m_closed || !m_states.empty(); });
+        if (m_states.empty())
+            return nullptr;
+        auto state = m_states.front();
+        m_states.pop_front();
+        return state;
+    }
+
+    bool try_pop(RENUM_BATCH_STATE *& state)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_states.empty())
+            return false;
+        state = m_states.front();
+        m_states.pop_front();
+        return true;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closed = true;
+        }
+        m_cv.notify_all();
+    }
+};
+
+// strip the BOM and cut '\x1A' and after
+void RENUM_prepare_text(std::string& text, bool& bom)
+{
+    bom = (text.compare(0, 3, UTF8_BOM) == 0);
+    if (bom)
+        text.erase(0, 3);
+
+    auto i0 = text.find('\x1A');
+    if (i0 != text.npos)
+        text.erase(i0);
+}
+
+// process the batch by the thread pool
+renum_error_t
+RENUM_run_batch_threads(
+    std::vector<RENUM_BATCH_ITEM>& items,
+    size_t jobs,
+    bool sync,
+    const RENUM_BATCH_FN& fn,
+    const RENUM_BATCH_DONE_FN& done)
+{
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    auto encoding = RENUM_get_encoding();
+    for (size_t iThread = 0; iThread < std::min(jobs, items.size()); ++iThread)
+    {
+        threads.emplace_back([&]() {
+            RENUM_set_encoding(encoding);
+            for (size_t i; (i = next++) < items.size(); )
+            {
+                auto& item = items[i];
+                std::string text;
+                bool bom = false;
+                item.error = RENUM_load_file(item.input, text, bom);
+                if (!item.error)
+                    item.error = fn(item, text, bom);
+                if (!item.error)
+                    item.error = RENUM_save_file(item.output, text, bom, sync);
+                if (done)
+                    done(item);
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    return 0;
+}
+
+#ifdef RENUM_HAVE_IO_URING
+
+// the submission and completion queues of io_uring
+struct RENUM_URING
+{
+    int m_fd = -1;
+    unsigned *m_sq_head, *m_sq_tail, *m_sq_mask, *m_sq_array;
+    unsigned *m_cq_head, *m_cq_tail, *m_cq_mask;
+    struct io_uring_sqe *m_sqes = nullptr;
+    struct io_uring_cqe *m_cqes;
+    void *m_sq_ptr = MAP_FAILED, *m_cq_ptr = MAP_FAILED;
+    size_t m_sq_size = 0, m_cq_size = 0, m_sqes_size = 0;
+    unsigned m_to_submit = 0;
+    unsigned m_cq_entries = 0;
+    std::map<uint64_t, unsigned> m_pending;    // the requests in flight by user_data
+
+    bool init(unsigned entries)
+    {
+        struct io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        m_fd = int(::syscall(__NR_io_uring_setup, entries, &params));
+        if (m_fd < 0)
+            return false;
+
+        m_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        m_cq_entries = params.cq_entries;
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+
+        m_sq_ptr = ::mmap(nullptr, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          m_fd, IORING_OFF_SQ_RING);
+        if (m_sq_ptr == MAP_FAILED)
+            return false;
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            m_cq_ptr = m_sq_ptr;
+        }
+        else
+        {
+            m_cq_ptr = ::mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              m_fd, IORING_OFF_CQ_RING);
+            if (m_cq_ptr == MAP_FAILED)
+                return false;
+        }
+        void *sqes = ::mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            m_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return false;
+        m_sqes = static_cast<struct io_uring_sqe *>(sqes);
+
+        auto sq = static_cast<char *>(m_sq_ptr), cq = static_cast<char *>(m_cq_ptr);
+        m_sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        m_sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        m_sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        m_sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        m_cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        m_cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        m_cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    ~RENUM_URING()
+    {
+        if (m_sqes)
+            ::munmap(m_sqes, m_sqes_size);
+        if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr)
+            ::munmap(m_cq_ptr, m_cq_size);
+        if (m_sq_ptr != MAP_FAILED)
+            ::munmap(m_sq_ptr, m_sq_size);
+        if (m_fd >= 0)
+            ::close(m_fd);
+    }
+
+    // get a submission queue entry
+    struct io_uring_sqe *get_sqe(void *user_data)
+    {
+        unsigned tail = *m_sq_tail;
+        if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) > *m_sq_mask)
+        {
+            enter(0);
+            tail = *m_sq_tail;
+        }
+        unsigned index = tail & *m_sq_mask;
+        struct io_uring_sqe *sqe = &m_sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = reinterpret_cast<uintptr_t>(user_data);
+        if (user_data)
+            ++m_pending[sqe->user_data];
+        m_sq_array[index] = index;
+        __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ++m_to_submit;
+        return sqe;
+    }
+
+    // submit the entries and wait for the completions
+    bool enter(unsigned min_complete)
+    {
+        for (;;)
+        {
+            unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+            int ret = int(::syscall(__NR_io_uring_enter, m_fd, m_to_submit, min_complete, flags, nullptr, 0));
+            if (ret >= 0)
+            {
+                m_to_submit -= std::min<unsigned>(m_to_submit, unsigned(ret));
+                return true;
+            }
+            if (errno != EINTR)
+                return false;
+        }
+    }
+
+    // get a completion queue entry
+    bool peek(struct io_uring_cqe& cqe)
+    {
+        unsigned head = *m_cq_head;
+        if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+            return false;
+        cqe = m_cqes[head & *m_cq_mask];
+        __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+        auto it = m_pending.find(cqe.user_data);
+        if (it != m_pending.end() && --it->second == 0)
+            m_pending.erase(it);
+        return true;
+    }
+
+    // cancel the requests in flight and wait for their completions (false if unable to wait)
+    template <typename T_FN>
+    bool drain(T_FN fn)
+    {
+        for (auto& pair : m_pending)
+        {
+            auto sqe = get_sqe(nullptr);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = pair.first;
+        }
+        struct io_uring_cqe cqe;
+        while (m_pending.size())
+        {
+            if (!enter(1))
+                return false;
+            while (peek(cqe))
+            {
+                if (cqe.user_data)
+                    fn(cqe);
+            }
+        }
+        return true;
+    }
+};
+
+enum RENUM_URING_STAGE
+{
+    RUS_OPEN_INPUT, RUS_READ, RUS_CLOSE_INPUT,
+    RUS_OPEN_OUTPUT, RUS_WRITE, RUS_FSYNC, RUS_CLOSE_OUTPUT,
+};
+
+#define RENUM_URING_ENTRIES 256
+#define RENUM_URING_READ_SIZE (64 * 1024)
+
+// process the batch by io_uring (returns false if io_uring is not available)
+bool
+RENUM_run_batch_uring(
+    std::vector<RENUM_BATCH_ITEM>& items,
+    size_t jobs,
+    bool sync,
+    const RENUM_BATCH_FN& fn,
+    const RENUM_BATCH_DONE_FN& done)
+{
+    RENUM_URING ring;
+    if (!ring.init(RENUM_URING_ENTRIES))
+        return false;
+
+    int efd = ::eventfd(0, EFD_CLOEXEC);
+    if (efd < 0)
+        return false;
+
+    // the renumbering workers
+    RENUM_BATCH_QUEUE work_queue, done_queue;
+    std::vector<std::thread> workers;
+    auto encoding = RENUM_get_encoding();
+    for (size_t iJob = 0; iJob < jobs; ++iJob)
+    {
+        workers.emplace_back([&]() {
+            RENUM_set_encoding(encoding);
+            while (RENUM_BATCH_STATE *state = work_queue.pop())
+            {
+                auto& item = *state->m_item;
+                // the compressed data was already read by the ring
+                if (state->m_compressed)
+                {
+#ifdef RENUM_HAVE_COMPRESSION
+                    if (RENUM_decompress_data(state->m_text))
+                        RENUM_prepare_text(state->m_text, state->m_bom);
+                    else
+#endif
+                    {
+                        std::fprintf(stderr, "renum: error: Unable to read file '%s'\n", item.input.c_str());
+                        item.error = 1;
+                    }
+                }
+                if (!item.error)
+                    item.error = fn(item, state->m_text, state->m_bom);
+                if (!item.error && state->m_bom)
+                    state->m_text.insert(0, UTF8_BOM);
+                auto compression = RENUM_compression_of_filename(item.output);
+                if (!item.error && compression != RENUM_COMPRESSION_NONE)
+                {
+#ifdef RENUM_HAVE_COMPRESSION
+                    if (!RENUM_compress_data(state->m_text, compression))
+#endif
+                    {
+                        std::fprintf(stderr, "renum: error: Unsupported compression of file '%s'\n", item.output.c_str());
+                        item.error = 1;
+                    }
+                }
+                done_queue.push(state);
+                uint64_t one = 1;
+                ssize_t written = ::write(efd, &one, sizeof(one));
+                (void)written;
+            }
+        });
+    }
+
+    std::vector<std::unique_ptr<RENUM_BATCH_STATE>> states(items.size());
+    size_t iNext = 0, cActive = 0, cFinished = 0;
+    size_t cMaxActive = std::max<size_t>(jobs * 4, 16);
+    // one request in flight per input plus the eventfd, doubled by the cancels
+    cMaxActive = std::min<size_t>(cMaxActive, ring.m_cq_entries / 2 - 1);
+    std::unique_ptr<uint64_t> efd_value(new uint64_t);
+    char efd_tag;
+
+    auto submit_read = [&](RENUM_BATCH_STATE *state) {
+        if (state->m_text.size() < state->m_done + RENUM_URING_READ_SIZE)
+            state->m_text.resize(std::max(state->m_text.size() * 2, state->m_done + RENUM_URING_READ_SIZE));
+        auto sqe = ring.get_sqe(state);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = state->m_fd;
+        sqe->addr = reinterpret_cast<uintptr_t>(&state->m_text[state->m_done]);
+        sqe->len = unsigned(state->m_text.size() - state->m_done);
+        sqe->off = state->m_done;
+        state->m_stage = RUS_READ;
+    };
+    auto submit_write = [&](RENUM_BATCH_STATE *state) {
+        auto sqe = ring.get_sqe(state);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = state->m_fd;
+        sqe->addr = reinterpret_cast<uintptr_t>(state->m_text.c_str() + state->m_done);
+        sqe->len = unsigned(std::min<size_t>(state->m_text.size() - state->m_done, 1U << 30));
+        sqe->off = state->m_tmp_filename.size() ? state->m_done : uint64_t(-1);  // -1: at the current position
+        state->m_stage = RUS_WRITE;
+    };
+    auto submit_close = [&](RENUM_BATCH_STATE *state, int stage) {
+        auto sqe = ring.get_sqe(state);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = state->m_fd;
+        state->m_fd = -1;
+        state->m_stage = stage;
+    };
+    auto submit_efd_read = [&]() {
+        auto sqe = ring.get_sqe(&efd_tag);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = efd;
+        sqe->addr = reinterpret_cast<uintptr_t>(efd_value.get());
+        sqe->len = sizeof(*efd_value);
+    };
+    auto finish = [&](RENUM_BATCH_STATE *state) {
+        if (state->m_fd >= 0)
+            ::close(state->m_fd);
+        if (state->m_tmp_filename.size())
+            std::remove(state->m_tmp_filename.c_str());
+        state->m_fd = -1;
+        state->m_text.clear();
+        state->m_text.shrink_to_fit();
+        --cActive;
+        ++cFinished;
+        if (done)
+            done(*state->m_item);
+    };
+    auto fail = [&](RENUM_BATCH_STATE *state, const char *msg, const std::string& filename) {
+        std::fprintf(stderr, "renum: error: %s '%s'\n", msg, filename.c_str());
+        state->m_item->error = 1;
+        finish(state);
+    };
+
+    submit_efd_read();
+    while (cFinished < items.size())
+    {
+        // open the next inputs
+        for (; iNext < items.size() && cActive < cMaxActive; ++iNext)
+        {
+            states[iNext].reset(new RENUM_BATCH_STATE);
+            auto state = states[iNext].get();
+            state->m_item = &items[iNext];
+            auto sqe = ring.get_sqe(state);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uintptr_t>(state->m_item->input.c_str());
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            state->m_stage = RUS_OPEN_INPUT;
+            ++cActive;
+        }
+
+        // open the outputs of the renumbered texts
+        RENUM_BATCH_STATE *state;
+        while (done_queue.try_pop(state))
+        {
+            if (state->m_item->error)
+            {
+                finish(state);
+                continue;
+            }
+
+            // keep the permissions of the destination (set by fchmod after opening)
+            struct stat st;
+            state->m_mode = -1;
+            if (::stat(state->m_item->output.c_str(), &st) == 0)
+                state->m_mode = int(st.st_mode & 07777);
+
+            // the symbolic links, the devices and the FIFOs are written in place
+            state->m_tmp_filename.clear();
+            if (!RENUM_output_in_place(state->m_item->output))
+            {
+                state->m_tmp_filename = state->m_item->output + ".renum-tmp" + std::to_string(::getpid()) +
+                                        "-" + std::to_string(state - states[0].get());
+            }
+            else
+            {
+                state->m_mode = -1;
+            }
+            auto& path = state->m_tmp_filename.size() ? state->m_tmp_filename : state->m_item->output;
+            auto sqe = ring.get_sqe(state);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uintptr_t>(path.c_str());
+            sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+            sqe->len = 0666;
+            state->m_done = 0;
+            state->m_stage = RUS_OPEN_OUTPUT;
+        }
+        if (cFinished == items.size())
+            break;
+
+        if (!ring.enter(1))
+            break;
+
+        struct io_uring_cqe cqe;
+        while (ring.peek(cqe))
+        {
+            if (cqe.user_data == reinterpret_cast<uintptr_t>(&efd_tag))
+            {
+                submit_efd_read();
+                continue;
+            }
+
+            state = reinterpret_cast<RENUM_BATCH_STATE *>(uintptr_t(cqe.user_data));
+            auto& item = *state->m_item;
+            int res = cqe.res;
+            switch (state->m_stage)
+            {
+            case RUS_OPEN_INPUT:
+                if (res < 0)
+                {
+                    fail(state, "Unable to open file", item.input);
+                    break;
+                }
+                state->m_fd = res;
+                state->m_done = 0;
+                submit_read(state);
+                break;
+            case RUS_READ:
+                if (res < 0)
+                {
+                    fail(state, "Unable to read file", item.input);
+                    break;
+                }
+                if (res > 0)
+                {
+                    state->m_done += res;
+                    submit_read(state);
+                    break;
+                }
+                state->m_text.resize(state->m_done);
+                submit_close(state, RUS_CLOSE_INPUT);
+                break;
+            case RUS_CLOSE_INPUT:
+                state->m_compressed = (RENUM_compression_of_data(state->m_text.c_str(), state->m_text.size()) !=
+                                       RENUM_COMPRESSION_NONE);
+                if (!state->m_compressed)
+                    RENUM_prepare_text(state->m_text, state->m_bom);
+                work_queue.push(state);
+                break;
+            case RUS_OPEN_OUTPUT:
+                if (res < 0)
+                {
+                    state->m_tmp_filename.clear();
+                    fail(state, "Unable to open file", item.output);
+                    break;
+                }
+                state->m_fd = res;
+                if (state->m_mode != -1)
+                    ::fchmod(res, mode_t(state->m_mode));
+                submit_write(state);
+                break;
+            case RUS_WRITE:
+                if (res < 0)
+                {
+                    fail(state, "Unable to write file", item.output);
+                    break;
+                }
+                state->m_done += res;
+                if (state->m_done < state->m_text.size())
+                {
+                    submit_write(state);
+                }
+                else if (sync)
+                {
+                    auto sqe = ring.get_sqe(state);
+                    sqe->opcode = IORING_OP_FSYNC;
+                    sqe->fd = state->m_fd;
+                    state->m_stage = RUS_FSYNC;
+                }
+                else
+                {
+                    submit_close(state, RUS_CLOSE_OUTPUT);
+                }
+                break;
+            case RUS_FSYNC:
+                // the pipes and the devices cannot be flushed
+                if (res < 0 && !(res == -EINVAL && state->m_tmp_filename.empty()))
+                {
+                    fail(state, "Unable to write file", item.output);
+                    break;
+                }
+                submit_close(state, RUS_CLOSE_OUTPUT);
+                break;
+            case RUS_CLOSE_OUTPUT:
+                if (res < 0 || (state->m_tmp_filename.size() &&
+                                (::rename(state->m_tmp_filename.c_str(), item.output.c_str()) != 0 ||
+                                 (sync && !RENUM_sync_parent_dir(item.output)))))
+                {
+                    fail(state, "Unable to write file", item.output);
+                    break;
+                }
+                state->m_tmp_filename.clear();
+                finish(state);
+                break;
+            }
+        }
+    }
+
+    work_queue.close();
+    for (auto& worker : workers)
+        worker.join();
+
+    // no buffer can be freed while the kernel may still write to it
+    bool drained = ring.drain([&](const struct io_uring_cqe& cqe) {
+        if (cqe.user_data == reinterpret_cast<uintptr_t>(&efd_tag))
+            return;
+        auto state = reinterpret_cast<RENUM_BATCH_STATE *>(uintptr_t(cqe.user_data));
+        if ((state->m_stage == RUS_OPEN_INPUT || state->m_stage == RUS_OPEN_OUTPUT) && cqe.res >= 0)
+            state->m_fd = cqe.res;
+    });
+    if (drained)
+    {
+        for (auto& state : states)
+        {
+            if (state && state->m_fd >= 0)
+                ::close(state->m_fd);
+            if (state && state->m_tmp_filename.size())
+                std::remove(state->m_tmp_filename.c_str());
+        }
+    }
+    else
+    {
+        for (auto& state : states)
+            state.release();
+        efd_value.release();
+    }
+    ::close(efd);
+
+    if (cFinished < items.size())
+    {
+        std::fprintf(stderr, "renum: error: io_uring failed\n");
+        for (auto& item : items)
+            item.error = 1;
+    }
+    return true;
+}
+
+#endif  // def RENUM_HAVE_IO_URING
+
+// process the batch by the I/O engine
+renum_error_t
+RENUM_run_batch(
+    std::vector<RENUM_BATCH_ITEM>& items,
+    size_t jobs,
+    bool sync,
+    RENUM_IO_ENGINE engine,
+    const RENUM_BATCH_FN& fn,
+    const RENUM_BATCH_DONE_FN& done)
+{
+    jobs = std::max<size_t>(jobs, 1);
+
+#ifdef RENUM_HAVE_IO_URING
+    if (engine != RENUM_IO_THREADS && RENUM_run_batch_uring(items, jobs, sync, fn, done))
+        engine = RENUM_IO_URING;
+    else
+#endif
+    if (engine == RENUM_IO_URING)
+    {
+        std::fprintf(stderr, "renum: error: io_uring is not available\n");
+        return 1;
+    }
+    else
+        RENUM_run_batch_threads(items, jobs, sync, fn, done);
+
+    for (auto& item : items)
+    {
+        if (item.error)
+            return 1;
+    }
+    return 0;
+}
+
+// get the size and the last modified time of a file
+bool RENUM_file_stat(const std::string& filename, unsigned long long& size, long long& mtime)
+{
+#ifdef _WIN32
+    struct _stat st;
+    if (_stat(filename.c_str(), &st) != 0)
+        return false;
+#else
+    struct stat st;
+    if (::stat(filename.c_str(), &st) != 0)
+        return false;
+#endif
+    size = (unsigned long long)st.st_size;
+    mtime = (long long)st.st_mtime;
+    return true;
+}
+
+// get the hash of the contents of a file
+bool RENUM_hash_file(const std::string& filename, uint64_t& hash)
+{
+    FILE *fin = fopen(filename.c_str(), "rb");
+    if (!fin)
+        return false;
+
+    RENUM_HASH_STATE state;
+    RENUM_hash_init(state);
+    char buf[64 * 1024];
+    size_t size;
+    while ((size = std::fread(buf, 1, sizeof(buf), fin)) > 0)
+        RENUM_hash_update(state, buf, size);
+    bool ok = !std::ferror(fin);
+    std::fclose(fin);
+
+    hash = RENUM_hash_final(state);
+    return ok;
+}
+
+// The journal record of a finished item:
+//   "HASH<TAB>SIZE<TAB>MTIME<TAB>OUTPUT_SIZE<TAB>OUTPUT_MTIME<TAB>INPUT<TAB>OUTPUT\n"
+// where HASH, OUTPUT_SIZE and OUTPUT_MTIME are of the output, SIZE and MTIME are
+// of the input. The old records without OUTPUT_SIZE and OUTPUT_MTIME are verified
+// by HASH only.
+struct RENUM_JOURNAL_RECORD
+{
+    uint64_t m_hash;
+    unsigned long long m_size;
+    long long m_mtime;
+    bool m_has_output_stat;
+    unsigned long long m_output_size;
+    long long m_output_mtime;
+};
+
+// process the batch by the I/O engine and record the finished items in the journal
+renum_error_t
+RENUM_run_batch_journaled(
+    std::vector<RENUM_BATCH_ITEM>& items,
+    size_t jobs,
+    bool sync,
+    RENUM_IO_ENGINE engine,
+    const std::string& journal_filename,
+    const RENUM_BATCH_FN& fn)
+{
+    // read the complete records of the journal (the last one wins)
+    std::map<std::pair<std::string, std::string>, RENUM_JOURNAL_RECORD> records;
+    bool newline = true;
+    if (FILE *fin = fopen(journal_filename.c_str(), "rb"))
+    {
+        std::string text;
+        char buf[64 * 1024];
+        size_t size;
+        while ((size = std::fread(buf, 1, sizeof(buf), fin)) > 0)
+            text.append(buf, size);
+        std::fclose(fin);
+
+        newline = (text.empty() || text[text.size() - 1] == '\n');
+        std::vector<std::string> lines;
+        mstr_split(lines, text, "\n");
+        if (!newline)
+            lines.pop_back(); // the record interrupted
+
+        for (auto& line : lines)
+        {
+            std::vector<std::string> fields;
+            mstr_split(fields, line, "\t");
+            if (fields.size() != 5 && fields.size() != 7)
+                continue;
+
+            RENUM_JOURNAL_RECORD record;
+            record.m_hash = std::strtoull(fields[0].c_str(), nullptr, 16);
+            record.m_size = std::strtoull(fields[1].c_str(), nullptr, 10);
+            record.m_mtime = std::strtoll(fields[2].c_str(), nullptr, 10);
+            record.m_has_output_stat = (fields.size() == 7);
+            record.m_output_size = 0;
+            record.m_output_mtime = 0;
+            if (record.m_has_output_stat)
+            {
+                record.m_output_size = std::strtoull(fields[3].c_str(), nullptr, 10);
+                record.m_output_mtime = std::strtoll(fields[4].c_str(), nullptr, 10);
+            }
+            records[std::make_pair(fields[fields.size() - 2], fields[fields.size() - 1])] = record;
+        }
+    }
+
+    // skip the items whose outputs are verified (hashed only if the output was touched),
+    // and keep the stat of the inputs of the rest taken before they are read
+    std::vector<RENUM_BATCH_ITEM> rest;
+    std::vector<size_t> indexes;
+    std::vector<RENUM_JOURNAL_RECORD> rest_records;
+    for (size_t iItem = 0; iItem < items.size(); ++iItem)
+    {
+        auto& item = items[iItem];
+        RENUM_JOURNAL_RECORD record;
+        record.m_has_output_stat = false;
+        if (!RENUM_file_stat(item.input, record.m_size, record.m_mtime))
+        {
+            record.m_size = 0;
+            record.m_mtime = -1;
+        }
+
+        auto it = records.find(std::make_pair(item.input, item.output));
+        if (it != records.end() && record.m_mtime != -1 &&
+            record.m_size == it->second.m_size && record.m_mtime == it->second.m_mtime)
+        {
+            unsigned long long size;
+            long long mtime;
+            uint64_t hash;
+            if (RENUM_file_stat(item.output, size, mtime) &&
+                ((it->second.m_has_output_stat &&
+                  size == it->second.m_output_size && mtime == it->second.m_output_mtime) ||
+                 (RENUM_hash_file(item.output, hash) && hash == it->second.m_hash)))
+            {
+                item.error = 0;
+                continue;
+            }
+        }
+        rest.push_back(item);
+        indexes.push_back(iItem);
+        rest_records.push_back(record);
+    }
+    if (rest.empty())
+        return 0;
+
+    FILE *journal = fopen(journal_filename.c_str(), "ab");
+    if (!journal)
+    {
+        std::fprintf(stderr, "renum: error: Unable to open file '%s'\n", journal_filename.c_str());
+        return 1;
+    }
+    if (!newline)
+        std::fputc('\n', journal);
+
+    // the journal writer hashes the outputs and appends the records, so that
+    // the I/O loop only queues the finished items
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<RENUM_BATCH_ITEM *> finished;
+    bool done = false;
+    bool ok = true;
+    std::thread writer([&]() {
+        for (;;)
+        {
+            RENUM_BATCH_ITEM *item;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [&]() { return done || !finished.empty(); });
+                if (finished.empty())
+                    break;
+                item = finished.front();
+                finished.pop_front();
+            }
+
+            // the input as it was before the item was read
+            auto& record = rest_records[item - &rest[0]];
+            if (record.m_mtime == -1 ||
+                !RENUM_file_stat(item->output, record.m_output_size, record.m_output_mtime) ||
+                !RENUM_hash_file(item->output, record.m_hash))
+            {
+                continue;
+            }
+
+            char buf[128];
+            std::snprintf(buf, sizeof(buf), "%016llx\t%llu\t%lld\t%llu\t%lld\t",
+                          (unsigned long long)record.m_hash, record.m_size, record.m_mtime,
+                          record.m_output_size, record.m_output_mtime);
+            std::string line = buf + item->input + "\t" + item->output + "\n";
+
+            if (std::fputs(line.c_str(), journal) < 0 || std::fflush(journal) != 0)
+                ok = false;
+#ifdef _WIN32
+            if (ok && sync)
+                ok = (_commit(_fileno(journal)) == 0);
+#else
+            if (ok && sync)
+                ok = (::fsync(fileno(journal)) == 0);
+#endif
+        }
+    });
+
+    // append the record of each finished item
+    renum_error_t error = RENUM_run_batch(rest, jobs, sync, engine, fn,
+        [&](RENUM_BATCH_ITEM& item) {
+            if (item.error)
+                return;
+            std::lock_guard<std::mutex> lock(mutex);
+            finished.push_back(&item);
+            cond.notify_one();
+        }
+    );
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        cond.notify_one();
+    }
+    writer.join();
+
+    if (std::fclose(journal) != 0)
+        ok = false;
+
+    for (size_t iItem = 0; iItem < rest.size(); ++iItem)
+        items[indexes[iItem]].error = rest[iItem].error;
+
+    if (!ok)
+    {
+        std::fprintf(stderr, "renum: error: Unable to write file '%s'\n", journal_filename.c_str());
+        return 1;
+    }
+    return error;
+}
+
+// check the line numbers without rewriting
+renum_error_t
+RENUM_check_lines(
+    const std::string& text,
+    RENUM_CHECK_RESULT& result,
+    renum_lineno_t new_start,
+    renum_lineno_t old_start,
+    renum_lineno_t step,
+    bool stop_early)
+{
+    result = RENUM_CHECK_RESULT();
+
+    // the end of the last line
+    size_t end = text.find_last_not_of(" \t\r\n");
+    end = (end == text.npos) ? 0 : end + 1;
+
+    // the trailing newline is also a part of the canonical form
+    // (renum writes "### " for the line of only a line number)
+    std::string tail;
+    if (end > 0)
+    {
+        size_t ich_last = text.rfind('\n', end - 1);
+        ich_last = (ich_last == text.npos) ? 0 : ich_last + 1;
+        if (text.find_first_not_of("0123456789", ich_last) >= end)
+            tail = " ";
+    }
+#ifdef RENUM_APPEND_NEWLINE
+    if (end > 0)
+        tail += "\n";
+#endif
+    bool canonical = (text.compare(end, text.npos, tail) == 0);
+
+    // collect the line numbers
+    std::vector<renum_lineno_t> numbers;
+    renum_lineno_t prev_line_no = 0;
+    size_t iLine = 1;
+    for (size_t ich = 0, ich_next; ich < end; ich = ich_next + 1, ++iLine)
+    {
+        ich_next = text.find('\n', ich);
+        if (ich_next == text.npos || ich_next > end)
+            ich_next = end;
+
+        auto old_line_no = RENUM_line_number_in_text(text, ich, ich_next);
+        if (old_line_no <= 0) // No line number?
+        {
+            result.no_line_numbers.push_back(iLine);
+            if (stop_early)
+                return 1;
+            continue;
+        }
+
+        if (old_line_no < prev_line_no)
+        {
+            result.unsorted.push_back(old_line_no);
+            if (stop_early)
+                return 1;
+        }
+        prev_line_no = old_line_no;
+
+        numbers.push_back(old_line_no);
+    }
+
+    // find duplicated line numbers
+    std::sort(numbers.begin(), numbers.end());
+    for (size_t i = 1; i < numbers.size(); ++i)
+    {
+        if (numbers[i - 1] != numbers[i])
+            continue;
+        if (result.duplicated.empty() || result.duplicated.back() != numbers[i])
+        {
+            result.duplicated.push_back(numbers[i]);
+            if (stop_early)
+                return 1;
+        }
+    }
+    numbers.erase(std::unique(numbers.begin(), numbers.end()), numbers.end());
+
+    // the index of the first line number to be renumbered
+    auto first = std::lower_bound(numbers.begin(), numbers.end(), old_start) - numbers.begin();
+    auto new_line_no_from_old = [&](renum_lineno_t old_line_no) -> renum_lineno_t {
+        auto i = std::lower_bound(numbers.begin(), numbers.end(), old_line_no) - numbers.begin();
+        if (i < first)
+            return old_line_no;
+        return new_start + renum_lineno_t(i - first) * step;
+    };
+
+    // scan the references
+    std::string line;
+    char str[16];
+    iLine = 1;
+    for (size_t ich = 0, ich_next; ich < end; ich = ich_next + 1, ++iLine)
+    {
+        ich_next = text.find('\n', ich);
+        if (ich_next == text.npos || ich_next > end)
+            ich_next = end;
+
+        size_t ich_body;
+        auto old_line_no = RENUM_line_number_in_text(text, ich, ich_next, &ich_body);
+        if (old_line_no <= 0)
+            continue;
+
+        // is the line in the form of "### ..." without trailing spaces (or "### ")?
+        if (canonical)
+        {
+            // the last line may have the space of "### " after the end
+            size_t ich_eol = std::min(text.find('\n', ich), text.size());
+            int len = std::snprintf(str, sizeof(str), "%lu ", (unsigned long)new_line_no_from_old(old_line_no));
+            if (ich_eol - ich < size_t(len) || text.compare(ich, len, str) != 0 ||
+                (ich_eol - ich > size_t(len) && std::strchr(" \t\r", text[ich_eol - 1])))
+            {
+                canonical = false;
+            }
+        }
+
+        // most lines have no keyword to refer to line numbers
+        if (!RENUM_may_refer_line_numbers(&text[ich_body], ich_next - ich_body))
+            continue;
+
+        line.assign(text, ich, ich_next - ich);
+        RENUM_Tokenizer tokenizer(line);
+        tokenizer.m_ich = ich_body - ich;
+        bool ok = RENUM_scan_line_numbers(tokenizer,
+            [&](RENUM_Tokenizer&, const std::string& word, renum_lineno_t number)
+            {
+                if (!std::binary_search(numbers.begin(), numbers.end(), number)) // not found?
+                {
+                    result.undefined.push_back(std::make_pair(old_line_no, number));
+                    return !stop_early;
+                }
+                if (canonical && word != std::to_string(new_line_no_from_old(number)))
+                    canonical = false;
+                return true;
+            }
+        );
+        if (!ok)
+            return 1;
+    }
+
+    if (!result.undefined.empty() || !result.no_line_numbers.empty() ||
+        !result.unsorted.empty() || !result.duplicated.empty())
+    {
+        return 1;
+    }
+
+    result.canonical = canonical;
+    return 0;
+}
+
+// make the edits of the line numbers by the mapping
+renum_error_t
+RENUM_edits_by_map(
+    const std::string& text,
+    size_t end,
+    const VskLineNoMap& old_to_new_line,
+    const std::vector<renum_lineno_t> *new_numbers,
+    std::vector<RENUM_EDIT>& edits,
+    bool force)
+{
+    edits.clear();
+
+    // add an edit if the number changes
+    auto add_edit = [&](size_t offset, const std::string& word, renum_lineno_t number) {
+        auto str = std::to_string(number);
+        if (word != str)
+            edits.push_back(RENUM_EDIT { offset, word, str });
+    };
+
+    std::string line;
+    size_t iLine = 1, iNumber = 0;
+    for (size_t ich = 0; ich < end; ich = ich + line.size() + 1, ++iLine)
+    {
+        size_t ich_next = text.find('\n', ich);
+        if (ich_next == text.npos || ich_next > end)
+            ich_next = end;
+        line.assign(text, ich, ich_next - ich);
+
+        char *endptr;
+        auto old_line_no = RENUM_line_number_from_line_text(line, &endptr);
+        if (old_line_no <= 0)
+            continue;
+
+        // the leading line number
+        size_t ich_number = line.find_first_not_of(" \t");
+        size_t cch_number = line.find_first_not_of("0123456789", ich_number);
+        if (cch_number == line.npos)
+            cch_number = line.size();
+        cch_number -= ich_number;
+        auto new_line_no = new_numbers ? (*new_numbers)[iNumber++] : old_to_new_line.find(old_line_no)->second;
+        add_edit(ich + ich_number, line.substr(ich_number, cch_number), new_line_no);
+
+        // the line numbers in the line
+        RENUM_Tokenizer tokenizer(line);
+        tokenizer.m_ich = endptr - &line[0];
+        bool ok = RENUM_scan_line_numbers(tokenizer,
+            [&](RENUM_Tokenizer& tokenizer, const std::string& word, renum_lineno_t number)
+            {
+                auto it = old_to_new_line.find(number);
+                if (it == old_to_new_line.end()) // not found?
+                {
+                    RENUM_report_error("Undefined line " + std::to_string(number) + " in " + std::to_string(old_line_no) + "\n",
+                                       RENUM_ERR_UNDEFINED_LINE, iLine, old_line_no, number, tokenizer.m_ich + 1);
+                    return force;
+                }
+
+                add_edit(ich + tokenizer.m_ich, word, it->second);
+                return true;
+            }
+        );
+        if (!ok)
+            return 1;
+    }
+
+    return 0;
+}
+
+// renumber lines as a list of edits
+renum_error_t
+RENUM_renumber_edits(
+    const std::string& text,
+    std::vector<RENUM_EDIT>& edits,
+    renum_lineno_t new_start,
+    renum_lineno_t old_start,
+    renum_lineno_t step,
+    bool force)
+{
+    edits.clear();
+
+    // the end of the last line
+    size_t end = text.find_last_not_of(" \t\r\n");
+    end = (end == text.npos) ? 0 : end + 1;
+
+    // create a mapping from old line to new line
+    VskLineNoMap old_to_new_line;
+    renum_lineno_t new_line_no = new_start, prev_line_no = 0;
+    std::string line;
+    size_t iLine = 1;
+    for (size_t ich = 0; ich < end; ich = ich + line.size() + 1, ++iLine)
+    {
+        size_t ich_next = text.find('\n', ich);
+        if (ich_next == text.npos || ich_next > end)
+            ich_next = end;
+        line.assign(text, ich, ich_next - ich);
+
+        // try to get old line number
+        auto old_line_no = RENUM_line_number_from_line_text(line);
+        if (old_line_no <= 0) // No line number?
+        {
+            if (!force)
+            {
+                RENUM_report_error("No line number found at line " + std::to_string(iLine) + "\n",
+                                   RENUM_ERR_NO_LINE_NUMBER, iLine);
+                return 1;
+            }
+            continue;
+        }
+
+        if (old_line_no < prev_line_no)
+        {
+            RENUM_report_error("Unsorted line " + std::to_string(old_line_no) + "\n",
+                               RENUM_ERR_UNSORTED_LINE, iLine, old_line_no);
+            return 1;
+        }
+        prev_line_no = old_line_no;
+
+        if (old_line_no >= old_start)
+        {
+            // update the mapping
+            old_to_new_line[old_line_no] = new_line_no;
+
+            // step up
+            new_line_no += step;
+        }
+        else
+        {
+            // update the mapping
+            old_to_new_line[old_line_no] = old_line_no;
+        }
+    }
+    RENUM_emit_line_map(old_to_new_line);
+
+    std::vector<RENUM_EDIT> number_edits;
+    if (RENUM_edits_by_map(text, end, old_to_new_line, nullptr, number_edits, force))
+        return 1;
+
+    // normalize the lines as RENUM_renumber_lines does
+    std::vector<RENUM_EDIT> normal_edits;
+    for (size_t ich = 0; ich < end; ich = ich + line.size() + 1)
+    {
+        size_t ich_next = text.find('\n', ich);
+        if (ich_next == text.npos || ich_next > end)
+            ich_next = end;
+        line.assign(text, ich, ich_next - ich);
+
+        // the trailing spaces and CR
+        size_t cch = line.find_last_not_of(" \t\r");
+        cch = (cch == line.npos) ? 0 : cch + 1;
+        std::string trailing = line.substr(cch);
+
+        if (RENUM_line_number_from_line_text(line) > 0)
+        {
+            // the leading spaces
+            size_t ich_number = line.find_first_not_of(" \t");
+            if (ich_number)
+                normal_edits.push_back(RENUM_EDIT { ich, line.substr(0, ich_number), "" });
+
+            // one space after the line number
+            size_t ich_digits = line.find_first_not_of("0123456789", ich_number);
+            if (ich_digits >= cch)
+            {
+                if (trailing != " ")
+                    normal_edits.push_back(RENUM_EDIT { ich + cch, trailing, " " });
+                continue;
+            }
+            if (line[ich_digits] != ' ')
+                normal_edits.push_back(RENUM_EDIT { ich + ich_digits, "", " " });
+        }
+
+        if (trailing.size())
+            normal_edits.push_back(RENUM_EDIT { ich + cch, trailing, "" });
+    }
+
+    // one newline at the end
+    if (end && text.compare(end, text.npos, "\n") != 0)
+        normal_edits.push_back(RENUM_EDIT { end, text.substr(end), "\n" });
+
+    std::merge(number_edits.begin(), number_edits.end(), normal_edits.begin(), normal_edits.end(),
+               std::back_inserter(edits), [](const RENUM_EDIT& a, const RENUM_EDIT& b) {
+                   return a.offset < b.offset;
+               });
+    return 0;
+}
+
+// renumber lines as few as possible
+renum_error_t
+RENUM_renumber_minimal(
+    const std::string& text,
+    std::vector<RENUM_EDIT>& edits,
+    const std::vector<RENUM_GAP>& gaps,
+    renum_lineno_t step,
+    bool force)
+{
+    edits.clear();
+
+    // the end of the last line
+    size_t end = text.find_last_not_of(" \t\r\n");
+    end = (end == text.npos) ? 0 : end + 1;
+
+    // collect the line numbers and count the references
+    std::vector<renum_lineno_t> olds;
+    std::map<renum_lineno_t, size_t> refs;
+    std::string line;
+    size_t iLine = 1;
+    for (size_t ich = 0; ich < end; ich = ich + line.size() + 1, ++iLine)
+    {
+        size_t ich_next = text.find('\n', ich);
+        if (ich_next == text.npos || ich_next > end)
+            ich_next = end;
+        line.assign(text, ich, ich_next - ich);
+
+        char *endptr;
+        auto old_line_no = RENUM_line_number_from_line_text(line, &endptr);
+        if (old_line_no <= 0) // No line number?
+        {
+            if (!force)
+            {
+                RENUM_report_error("No line number found at line " + std::to_string(iLine) + "\n",
+                                   RENUM_ERR_NO_LINE_NUMBER, iLine);
+                return 1;
+            }
+            continue;
+        }
+        olds.push_back(old_line_no);
+
+        RENUM_Tokenizer tokenizer(line);
+        tokenizer.m_ich = endptr - &line[0];
+        RENUM_scan_line_numbers(tokenizer,
+            [&](RENUM_Tokenizer&, const std::string&, renum_lineno_t number) {
+                ++refs[number];
+                return true;
+            }
+        );
+    }
+
+    // the minimum differences between the new line numbers
+    size_t count = olds.size();
+    std::vector<renum_lineno_t> diffs(count, 1);
+    for (size_t i = 0; i + 1 < count; ++i)
+    {
+        for (auto& gap : gaps)
+        {
+            if (gap.after == olds[i])
+                diffs[i] = std::max(diffs[i], gap.count + 1);
+        }
+    }
+
+    // The line i and j (i < j) can keep the numbers if and only if
+    // olds[j] - olds[i] >= sums[j] - sums[i], i.e. keys[i] <= keys[j].
+    // Find the heaviest non-decreasing subsequence of the keys.
+    std::vector<long long> sums(count), keys(count);
+    long long sum = 1; // the new line numbers are positive
+    for (size_t i = 0; i < count; ++i)
+    {
+        sums[i] = sum;
+        keys[i] = (long long)olds[i] - sum;
+        sum += diffs[i];
+    }
+    std::vector<long long> ranks;
+    for (auto key : keys)
+    {
+        if (key >= 0)
+            ranks.push_back(key);
+    }
+    std::sort(ranks.begin(), ranks.end());
+    ranks.erase(std::unique(ranks.begin(), ranks.end()), ranks.end());
+
+    // Fenwick tree of the prefix maximums of (weight, index + 1)
+    typedef std::pair<size_t, size_t> BEST;
+    std::vector<BEST> tree(ranks.size() + 1), bests(count);
+    std::vector<size_t> prevs(count);
+    BEST best;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (keys[i] < 0)
+            continue;
+        size_t rank = std::upper_bound(ranks.begin(), ranks.end(), keys[i]) - ranks.begin();
+
+        BEST prev;
+        for (size_t k = rank; k > 0; k &= k - 1)
+            prev = std::max(prev, tree[k]);
+
+        bests[i] = BEST(prev.first + 1 + refs[olds[i]], i + 1);
+        prevs[i] = prev.second;
+        for (size_t k = rank; k < tree.size(); k += k & (0 - k))
+            tree[k] = std::max(tree[k], bests[i]);
+        best = std::max(best, bests[i]);
+    }
+
+    std::vector<bool> kept(count);
+    for (size_t i = best.second; i > 0; i = prevs[i - 1])
+        kept[i - 1] = true;
+
+    // assign the new line numbers between the kept ones
+    std::vector<renum_lineno_t> news(count);
+    long long prev_no = 0;
+    size_t iPrev = 0; // the index of the previous kept line + 1
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (kept[i])
+        {
+            news[i] = olds[i];
+            prev_no = olds[i];
+            iPrev = i + 1;
+            continue;
+        }
+
+        size_t j = i + 1;
+        while (j < count && !kept[j])
+            ++j;
+
+        long long lo = (i > 0) ? news[i - 1] + diffs[i - 1] : 1;
+        long long no;
+        if (j < count)
+        {
+            // spread evenly within the room
+            long long hi = (long long)olds[j] - (sums[j] - sums[i]);
+            no = prev_no + ((long long)olds[j] - prev_no) * (i + 1 - iPrev) / (j + 1 - iPrev);
+            no = std::max(lo, std::min(hi, no));
+        }
+        else
+        {
+            no = std::max<long long>(lo, (i > 0 ? news[i - 1] : 0) + step);
+        }
+        news[i] = renum_lineno_t(no);
+    }
+
+    // the mapping (the last one of the duplicated lines wins)
+    VskLineNoMap old_to_new_line;
+    for (size_t i = 0; i < count; ++i)
+        old_to_new_line[olds[i]] = news[i];
+
+    return RENUM_edits_by_map(text, end, old_to_new_line, &news, edits, force);
+}
+
+// apply the edits to the text
+void RENUM_apply_edits(std::string& text, const std::vector<RENUM_EDIT>& edits)
+{
+    for (auto it = edits.rbegin(); it != edits.rend(); ++it)
+    {
+        assert(text.compare(it->offset, it->old_text.size(), it->old_text) == 0);
+        text.replace(it->offset, it->old_text.size(), it->new_text);
+    }
+}
+
+#define RENUM_DIFF_CONTEXT 3
+
+// generate a unified diff of the edits
+void RENUM_unified_diff(
+    std::string& diff,
+    const std::string& filename,
+    const std::string& text,
+    const std::vector<RENUM_EDIT>& edits)
+{
+    diff.clear();
+    if (edits.empty())
+        return;
+
+    // the offsets of the lines
+    std::vector<size_t> starts;
+    for (size_t ich = 0; ich < text.size(); )
+    {
+        starts.push_back(ich);
+        ich = text.find('\n', ich);
+        if (ich == text.npos)
+            break;
+        ++ich;
+    }
+    starts.push_back(text.size());
+    size_t cLines = starts.size() - 1;
+
+    // the line index of the offset (the end of the text is in the last line)
+    auto line_of = [&](size_t offset) {
+        size_t iLine = std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin() - 1;
+        return std::min(iLine, cLines ? cLines - 1 : 0);
+    };
+
+    // the blocks of the consecutive changed lines and their first edits
+    struct BLOCK
+    {
+        size_t iFirst, iEnd, iEdit;
+    };
+    std::vector<BLOCK> blocks;
+    for (size_t iEdit = 0; iEdit < edits.size(); ++iEdit)
+    {
+        auto& edit = edits[iEdit];
+        size_t iFirst = line_of(edit.offset);
+        size_t iEnd = line_of(edit.offset + std::max<size_t>(edit.old_text.size(), 1) - 1) + 1;
+        if (blocks.size() && iFirst <= blocks.back().iEnd)
+            blocks.back().iEnd = std::max(blocks.back().iEnd, iEnd);
+        else
+            blocks.push_back(BLOCK { iFirst, iEnd, iEdit });
+    }
+
+    std::string hunk;
+    auto add_line = [&](char prefix, const std::string& line) {
+        hunk += prefix;
+        hunk += line;
+        if (line.empty() || line.back() != '\n')
+            hunk += "\n\\ No newline at end of file\n";
+    };
+    auto old_lines = [&](size_t iFirst, size_t iEnd) {
+        return text.substr(starts[iFirst], starts[iEnd] - starts[iFirst]);
+    };
+    auto add_lines = [&](char prefix, const std::string& lines) {
+        size_t count = 0;
+        for (size_t ich = 0; ich < lines.size(); ++count)
+        {
+            size_t ich_next = lines.find('\n', ich);
+            ich_next = (ich_next == lines.npos) ? lines.size() : ich_next + 1;
+            add_line(prefix, lines.substr(ich, ich_next - ich));
+            ich = ich_next;
+        }
+        return count;
+    };
+
+    diff += "--- " + filename + "\n";
+    diff += "+++ " + filename + "\n";
+
+    long long delta = 0; // the number of the lines added before the hunk
+    for (size_t iBlock = 0; iBlock < blocks.size(); )
+    {
+        // the range of the hunk
+        size_t iFirst = blocks[iBlock].iFirst;
+        iFirst = (iFirst > RENUM_DIFF_CONTEXT) ? iFirst - RENUM_DIFF_CONTEXT : 0;
+        size_t iBlockEnd = iBlock + 1;
+        while (iBlockEnd < blocks.size() &&
+               blocks[iBlockEnd].iFirst <= blocks[iBlockEnd - 1].iEnd + 2 * RENUM_DIFF_CONTEXT)
+        {
+            ++iBlockEnd;
+        }
+        size_t iLast = std::min(blocks[iBlockEnd - 1].iEnd + RENUM_DIFF_CONTEXT, cLines);
+
+        hunk.clear();
+        size_t cNewLines = 0;
+        for (size_t iLine = iFirst; iLine < iLast; )
+        {
+            if (iBlock == iBlockEnd || iLine != blocks[iBlock].iFirst)
+            {
+                add_line(' ', old_lines(iLine, iLine + 1));
+                ++iLine;
+                ++cNewLines;
+                continue;
+            }
+
+            // apply the edits of the block to its lines
+            auto& block = blocks[iBlock];
+            auto lines = old_lines(block.iFirst, block.iEnd);
+            size_t iEditEnd = (iBlock + 1 < blocks.size()) ? blocks[iBlock + 1].iEdit : edits.size();
+            while (iEditEnd > block.iEdit)
+            {
+                auto& edit = edits[--iEditEnd];
+                lines.replace(edit.offset - starts[block.iFirst], edit.old_text.size(), edit.new_text);
+            }
+            add_lines('-', old_lines(block.iFirst, block.iEnd));
+            cNewLines += add_lines('+', lines);
+            iLine = block.iEnd;
+            ++iBlock;
+        }
+
+        diff += "@@ -" + std::to_string(iFirst + 1) + "," + std::to_string(iLast - iFirst) +
+                " +" + std::to_string(iFirst + 1 + delta) + "," + std::to_string(cNewLines) + " @@\n";
+        diff += hunk;
+        delta += (long long)cNewLines - (long long)(iLast - iFirst);
+    }
+}
+
+// append the text escaping the backslash, the tab, CR and LF
+void RENUM_escape_text(std::string& str, const std::string& text)
+{
+    for (auto ch : text)
+    {
+        switch (ch)
+        {
+        case '\\': str += "\\\\"; break;
+        case '\t': str += "\\t"; break;
+        case '\r': str += "\\r"; break;
+        case '\n': str += "\\n"; break;
+        default: str += ch; break;
+        }
+    }
+}
+
+// generate an edit list (offset, old text and new text separated by tabs)
+void RENUM_edit_list(std::string& list, const std::vector<RENUM_EDIT>& edits)
+{
+    list.clear();
+    for (auto& edit : edits)
+    {
+        list += std::to_string(edit.offset);
+        list += '\t';
+        RENUM_escape_text(list, edit.old_text);
+        list += '\t';
+        RENUM_escape_text(list, edit.new_text);
+        list += '\n';
+    }
+}
+
+#define RENUM_HASH_K 0x9E3779B97F4A7C15ULL
+
+inline uint64_t RENUM_hash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+inline uint64_t RENUM_hash_word(uint64_t h, const unsigned char *p)
+{
+    uint64_t word;
+    std::memcpy(&word, p, 8);
+    return (h ^ RENUM_hash_mix(word * RENUM_HASH_K)) * RENUM_HASH_K + 0x632BE59BD9B4E019ULL;
+}
+
+void RENUM_hash_init(RENUM_HASH_STATE& state, uint64_t seed)
+{
+    state.m_hash = seed;
+    state.m_size = 0;
+    state.m_cTail = 0;
+}
+
+void RENUM_hash_update(RENUM_HASH_STATE& state, const void *data, size_t size)
+{
+    auto p = static_cast<const unsigned char *>(data);
+    state.m_size += size;
+
+    // complete the word of the tail
+    if (state.m_cTail)
+    {
+        size_t cb = std::min(size, 8 - state.m_cTail);
+        std::memcpy(&state.m_tail[state.m_cTail], p, cb);
+        state.m_cTail += cb;
+        p += cb;
+        size -= cb;
+        if (state.m_cTail < 8)
+            return;
+        state.m_hash = RENUM_hash_word(state.m_hash, state.m_tail);
+        state.m_cTail = 0;
+    }
+
+    for (; size >= 8; p += 8, size -= 8)
+        state.m_hash = RENUM_hash_word(state.m_hash, p);
+
+    std::memcpy(state.m_tail, p, size);
+    state.m_cTail = size;
+}
+
+uint64_t RENUM_hash_final(RENUM_HASH_STATE& state)
+{
+    uint64_t word = 0;
+    for (size_t i = 0; i < state.m_cTail; ++i)
+        word |= uint64_t(state.m_tail[i]) << (8 * i);
+    uint64_t h = (state.m_hash ^ RENUM_hash_mix(word * RENUM_HASH_K)) * RENUM_HASH_K;
+    return RENUM_hash_mix(h ^ (state.m_size * RENUM_HASH_K));
+}
+
+// a fast 64-bit hash
+uint64_t RENUM_hash(const void *data, size_t size, uint64_t seed)
+{
+    RENUM_HASH_STATE state;
+    RENUM_hash_init(state, seed);
+    RENUM_hash_update(state, data, size);
+    return RENUM_hash_final(state);
+}
+
+// copy the contents of the file (by reflink if possible)
+bool RENUM_copy_file_contents(FILE *fout, const std::string& src_filename)
+{
+    FILE *fin = fopen(src_filename.c_str(), "rb");
+    if (!fin)
+        return false;
+
+#if defined(__linux__) && defined(FICLONE)
+    if (std::fflush(fout) == 0 && ::ioctl(fileno(fout), FICLONE, fileno(fin)) == 0)
+    {
+        std::fclose(fin);
+        return std::fseek(fout, 0, SEEK_END) == 0;
+    }
+#endif
+
+    bool ok = true;
+    char buf[64 * 1024];
+    size_t size;
+    while (ok && (size = std::fread(buf, 1, sizeof(buf), fin)) > 0)
+        ok = (std::fwrite(buf, size, 1, fout) == 1);
+    if (std::ferror(fin))
+        ok = false;
+
+    std::fclose(fin);
+    return ok;
+}
+
+// the file of the cache entry
+std::string RENUM_cache_entry(const std::string& cache_dir, uint64_t key)
+{
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%016llx.bas", (unsigned long long)key);
+    return cache_dir + "/" + buf;
+}
+
+// enumerate the cache entries
+template <typename T_FN>
+void RENUM_cache_entries(const std::string& cache_dir, T_FN fn)
+{
+    auto is_entry = [](const std::string& name) {
+        return name.size() == 20 && name.compare(16, 4, ".bas") == 0;
+    };
+
+#ifdef _WIN32
+    WIN32_FIND_DATAA find;
+    HANDLE hFind = FindFirstFileA((cache_dir + "/*.bas").c_str(), &find);
+    if (hFind == INVALID_HANDLE_VALUE)
+        return;
+    do
+    {
+        std::string name = find.cFileName;
+        if (!is_entry(name))
+            continue;
+        auto filename = cache_dir + "/" + name;
+        struct _stat st;
+        if (_stat(filename.c_str(), &st) == 0)
+            fn(filename, (unsigned long long)st.st_size, st.st_mtime);
+    } while (FindNextFileA(hFind, &find));
+    FindClose(hFind);
+#else
+    DIR *dir = opendir(cache_dir.c_str());
+    if (!dir)
+        return;
+    while (struct dirent *entry = readdir(dir))
+    {
+        std::string name = entry->d_name;
+        if (!is_entry(name))
+            continue;
+        auto filename = cache_dir + "/" + name;
+        struct stat st;
+        if (::stat(filename.c_str(), &st) == 0)
+            fn(filename, (unsigned long long)st.st_size, st.st_mtime);
+    }
+    closedir(dir);
+#endif
+}
+
+// The counters of the cache ("stats.txt") are updated under the file lock:
+//   "hits N\nmisses N\nsize N\n"
+// where size is the total size of the entries at the last eviction scan plus
+// the ones added since, so the directory is read only when it is too large.
+template <typename T_FN>
+bool RENUM_cache_update(const std::string& cache_dir, T_FN fn)
+{
+    auto filename = cache_dir + "/stats.txt";
+#ifdef _WIN32
+    int fd = _open(filename.c_str(), _O_RDWR | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+    if (fd < 0)
+        return false;
+    if (_locking(fd, _LK_LOCK, 1) != 0)
+    {
+        _close(fd);
+        return false;
+    }
+    char buf[128];
+    int cb = _read(fd, buf, sizeof(buf) - 1);
+#else
+    int fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return false;
+    if (::flock(fd, LOCK_EX) != 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    char buf[128];
+    ssize_t cb = ::pread(fd, buf, sizeof(buf) - 1, 0);
+#endif
+    buf[(cb > 0) ? cb : 0] = 0;
+
+    RENUM_CACHE_STATS counts;
+    if (std::sscanf(buf, "hits %llu misses %llu size %llu", &counts.hits, &counts.misses, &counts.size) < 2)
+        counts = RENUM_CACHE_STATS();
+    fn(counts);
+
+    int len = std::snprintf(buf, sizeof(buf), "hits %llu\nmisses %llu\nsize %llu\n",
+                            counts.hits, counts.misses, counts.size);
+#ifdef _WIN32
+    _lseek(fd, 0, SEEK_SET);
+    bool ok = (_write(fd, buf, len) == len && _chsize(fd, len) == 0);
+    _lseek(fd, 0, SEEK_SET);
+    _locking(fd, _LK_UNLCK, 1);
+    _close(fd);
+#else
+    bool ok = (::pwrite(fd, buf, len, 0) == len && ::ftruncate(fd, len) == 0);
+    ::close(fd);
+#endif
+    return ok;
+}
+
+// count a hit or a miss of the cache
+void RENUM_cache_count(const std::string& cache_dir, bool hit)
+{
+    RENUM_cache_update(cache_dir, [&](RENUM_CACHE_STATS& counts) {
+        if (hit)
+            ++counts.hits;
+        else
+            ++counts.misses;
+    });
+}
+
+// get the statistics of the cache
+void RENUM_cache_stats(const std::string& cache_dir, RENUM_CACHE_STATS& stats)
+{
+    stats = RENUM_CACHE_STATS();
+
+    if (FILE *fp = fopen((cache_dir + "/stats.txt").c_str(), "r"))
+    {
+        if (std::fscanf(fp, "hits %llu misses %llu", &stats.hits, &stats.misses) != 2)
+            stats.hits = stats.misses = 0;
+        std::fclose(fp);
+    }
+
+    RENUM_cache_entries(cache_dir, [&](const std::string&, unsigned long long size, time_t) {
+        ++stats.entries;
+        stats.size += size;
+    });
+}
+
+// get the result from the cache
+bool RENUM_cache_fetch(const std::string& cache_dir, uint64_t key, const std::string& out_filename, bool sync)
+{
+#ifdef _WIN32
+    _mkdir(cache_dir.c_str());
+#else
+    ::mkdir(cache_dir.c_str(), 0777);
+#endif
+
+    auto entry = RENUM_cache_entry(cache_dir, key);
+    struct stat st;
+    if (::stat(entry.c_str(), &st) != 0)
+    {
+        RENUM_cache_count(cache_dir, false);
+        return false;
+    }
+
+    // the cached output is already compressed
+    std::string tmp_filename;
+    FILE *fout = RENUM_open_output(out_filename, tmp_filename, false);
+    if (!fout)
+        return false;
+
+    bool ok = RENUM_copy_file_contents(fout, entry);
+    if (RENUM_close_output(fout, out_filename, tmp_filename, sync, ok) != 0)
+        return false;
+
+    // the most recently used
+    utime(entry.c_str(), nullptr);
+
+    RENUM_cache_count(cache_dir, true);
+    return true;
+}
+
+// get the cached text
+bool RENUM_cache_fetch_text(const std::string& cache_dir, uint64_t key, std::string& text)
+{
+#ifdef _WIN32
+    _mkdir(cache_dir.c_str());
+#else
+    ::mkdir(cache_dir.c_str(), 0777);
+#endif
+
+    auto entry = RENUM_cache_entry(cache_dir, key);
+    FILE *fin = fopen(entry.c_str(), "rb");
+    if (!fin)
+    {
+        RENUM_cache_count(cache_dir, false);
+        return false;
+    }
+
+    std::string data;
+    char buf[64 * 1024];
+    size_t size;
+    while ((size = std::fread(buf, 1, sizeof(buf), fin)) > 0)
+        data.append(buf, size);
+    bool ok = !std::ferror(fin);
+    std::fclose(fin);
+    if (!ok)
+        return false;
+    text = std::move(data);
+
+    // the most recently used
+    utime(entry.c_str(), nullptr);
+
+    RENUM_cache_count(cache_dir, true);
+    return true;
+}
+
+// count the added entry and evict the least recently used entries if too large
+void RENUM_cache_added(const std::string& cache_dir, const std::string& entry, unsigned long long max_size)
+{
+    struct stat st;
+    if (::stat(entry.c_str(), &st) != 0)
+        return;
+
+    RENUM_cache_update(cache_dir, [&](RENUM_CACHE_STATS& counts) {
+        counts.size += (unsigned long long)st.st_size;
+        if (counts.size <= max_size)
+            return;
+
+        struct ENTRY
+        {
+            std::string filename;
+            unsigned long long size;
+            time_t mtime;
+        };
+        std::vector<ENTRY> entries;
+        unsigned long long total = 0;
+        RENUM_cache_entries(cache_dir, [&](const std::string& filename, unsigned long long size, time_t mtime) {
+            entries.push_back(ENTRY { filename, size, mtime });
+            total += size;
+        });
+
+        // leave the room not to scan again soon
+        if (total > max_size / 10 * 9)
+        {
+            std::sort(entries.begin(), entries.end(), [](const ENTRY& a, const ENTRY& b) {
+                return a.mtime < b.mtime;
+            });
+            for (auto& item : entries)
+            {
+                if (total <= max_size / 10 * 9)
+                    break;
+                if (item.filename == entry)
+                    continue;
+                if (std::remove(item.filename.c_str()) == 0)
+                    total -= item.size;
+            }
+        }
+        counts.size = total;
+    });
+}
+
+// store the result to the cache
+renum_error_t
+RENUM_cache_store(
+    const std::string& cache_dir,
+    uint64_t key,
+    const std::string& out_filename,
+    unsigned long long max_size)
+{
+    auto entry = RENUM_cache_entry(cache_dir, key);
+    std::string tmp_filename;
+    FILE *fout = RENUM_open_output(entry, tmp_filename);
+    if (!fout)
+        return 1;
+
+    bool ok = RENUM_copy_file_contents(fout, out_filename);
+    renum_error_t error = RENUM_close_output(fout, entry, tmp_filename, false, ok);
+    if (error)
+        return error;
+
+    RENUM_cache_added(cache_dir, entry, max_size);
+    return 0;
+}
+
+// store the text to the cache
+renum_error_t
+RENUM_cache_store_text(
+    const std::string& cache_dir,
+    uint64_t key,
+    const std::string& text,
+    unsigned long long max_size)
+{
+    auto entry = RENUM_cache_entry(cache_dir, key);
+    std::string tmp_filename;
+    FILE *fout = RENUM_open_output(entry, tmp_filename, false);
+    if (!fout)
+        return 1;
+
+    RENUM_SEGMENT segment = { text.c_str(), text.size() };
+    bool ok = RENUM_write_segments(fout, &segment, 1);
+    renum_error_t error = RENUM_close_output(fout, entry, tmp_filename, false, ok);
+    if (error)
+        return error;
+
+    RENUM_cache_added(cache_dir, entry, max_size);
+    return 0;
+}
+
+// get the map of the old and new line numbers of a file
+renum_error_t
+RENUM_line_map_of_file(
+    const std::string& filename,
+    RENUM_LINE_MAP& map,
+    renum_lineno_t new_start,
+    renum_lineno_t old_start,
+    renum_lineno_t step)
+{
+    map.clear();
+
+    FILE *fin = RENUM_fopen_input(filename);
+    if (!fin)
+    {
+        std::fprintf(stderr, "renum: error: Unable to open file '%s'\n", filename.c_str());
+        return 1;
+    }
+
+    // count the line numbers
+    std::map<renum_lineno_t, size_t> counts;
+    RENUM_LINE_READER reader(fin, true);
+    std::string line;
+    renum_lineno_t old_line_no;
+    while (reader.next(line, old_line_no))
+    {
+        if (old_line_no > 0)
+            ++counts[old_line_no];
+    }
+    std::fclose(fin);
+    if (reader.m_error)
+        return 1;
+
+    // the same mapping as the renumbering
+    VskLineNoMap old_to_new_line;
+    RENUM_map_line_numbers(old_to_new_line, counts, new_start, old_start, step);
+    map.assign(old_to_new_line.begin(), old_to_new_line.end());
+    return 0;
+}
+
+// The binary line map (little endian):
+//   "RENUMMAP" (8 bytes), version (4 bytes), log2 of the slot count (4 bytes),
+//   the entry count (8 bytes), then the open addressing hash table of the slots
+//   of the old and new line numbers (4 bytes each; the old one is zero if empty).
+#define RENUM_MAP_MAGIC "RENUMMAP"
+#define RENUM_MAP_VERSION 1
+#define RENUM_MAP_HEADER_SIZE 24
+#define RENUM_MAP_SLOT_SIZE 8
+
+inline void RENUM_put_le(char *ptr, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+        ptr[i] = char(value >> (8 * i));
+}
+
+inline uint64_t RENUM_get_le(const char *ptr, size_t size)
+{
+    uint64_t value = 0;
+    for (size_t i = size; i-- > 0; )
+        value = (value << 8) | (unsigned char)ptr[i];
+    return value;
+}
+
+// the first slot of the old line number
+inline size_t RENUM_map_slot(uint32_t old_line_no, uint32_t bits)
+{
+    return uint32_t(old_line_no * 0x9E3779B1U) >> (32 - bits);
+}
+
+// build the binary line map
+bool RENUM_line_map_image(const RENUM_LINE_MAP& map, std::string& image)
+{
+    uint32_t bits = 1;
+    while ((size_t(1) << bits) < map.size() * 2)
+        ++bits;
+    size_t mask = (size_t(1) << bits) - 1;
+
+    image.assign(RENUM_MAP_HEADER_SIZE + (mask + 1) * RENUM_MAP_SLOT_SIZE, 0);
+    std::memcpy(&image[0], RENUM_MAP_MAGIC, 8);
+    RENUM_put_le(&image[8], RENUM_MAP_VERSION, 4);
+    RENUM_put_le(&image[12], bits, 4);
+    RENUM_put_le(&image[16], map.size(), 8);
+
+    char *slots = &image[RENUM_MAP_HEADER_SIZE];
+    for (auto& pair : map)
+    {
+        if (pair.first <= 0 || pair.first > 0xFFFFFFFF || pair.second > 0xFFFFFFFF)
+            return false;
+
+        size_t slot = RENUM_map_slot(uint32_t(pair.first), bits);
+        while (RENUM_get_le(&slots[slot * RENUM_MAP_SLOT_SIZE], 4) != 0)
+            slot = (slot + 1) & mask;
+        RENUM_put_le(&slots[slot * RENUM_MAP_SLOT_SIZE], pair.first, 4);
+        RENUM_put_le(&slots[slot * RENUM_MAP_SLOT_SIZE + 4], pair.second, 4);
+    }
+    return true;
+}
+
+// save the map of the old and new line numbers
+renum_error_t
+RENUM_save_line_map(const std::string& filename, const RENUM_LINE_MAP& map, bool text_format, bool sync)
+{
+    std::string image;
+    if (text_format)
+    {
+        for (auto& pair : map)
+            image += std::to_string(pair.first) + "\t" + std::to_string(pair.second) + "\n";
+    }
+    else if (!RENUM_line_map_image(map, image))
+    {
+        std::fprintf(stderr, "renum: error: Too large line number for '%s'\n", filename.c_str());
+        return 1;
+    }
+
+    RENUM_SEGMENT segment = { image.c_str(), image.size() };
+    return RENUM_save_segments(filename, &segment, 1, sync);
+}
+
+// the read-only file mapped into memory
+struct RENUM_MAPPED_FILE
+{
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+#ifdef _WIN32
+    HANDLE m_hMapping = nullptr;
+#endif
+
+    bool open(const std::string& filename)
+    {
+#ifdef _WIN32
+        HANDLE hFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                   OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (hFile == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER size;
+        bool ok = !!GetFileSizeEx(hFile, &size);
+        m_size = ok ? size_t(size.QuadPart) : 0;
+        if (ok && m_size)
+            m_hMapping = CreateFileMappingA(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(hFile);
+        if (m_hMapping)
+            m_data = static_cast<const char *>(MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+        return ok && (!m_size || m_data);
+#else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        bool ok = (::fstat(fd, &st) == 0);
+        m_size = ok ? size_t(st.st_size) : 0;
+        if (ok && m_size)
+        {
+            void *data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = (data != MAP_FAILED);
+            if (ok)
+                m_data = static_cast<const char *>(data);
+        }
+        ::close(fd);
+        return ok;
+#endif
+    }
+
+    ~RENUM_MAPPED_FILE()
+    {
+#ifdef _WIN32
+        if (m_data)
+            UnmapViewOfFile(m_data);
+        if (m_hMapping)
+            CloseHandle(m_hMapping);
+#else
+        if (m_data)
+            ::munmap(const_cast<char *>(m_data), m_size);
+#endif
+    }
+};
+
+// the lookup of the binary line map
+struct RENUM_LINE_MAP_VIEW
+{
+    RENUM_MAPPED_FILE m_file;
+    std::string m_image;    // the image converted from the text map
+    const char *m_slots = nullptr;
+    uint32_t m_bits = 0;
+
+    bool load(const std::string& filename)
+    {
+        if (!m_file.open(filename))
+            return false;
+
+        const char *data = m_file.m_data;
+        size_t size = m_file.m_size;
+        if (size < RENUM_MAP_HEADER_SIZE || std::memcmp(data, RENUM_MAP_MAGIC, 8) != 0)
+        {
+            // the text map
+            std::string text(data ? data : "", size);
+            std::vector<std::string> lines;
+            mstr_split(lines, text, "\n");
+            RENUM_LINE_MAP map;
+            for (auto& line : lines)
+            {
+                char *endptr;
+                renum_lineno_t old_line_no = std::strtoul(line.c_str(), &endptr, 10);
+                renum_lineno_t new_line_no = std::strtoul(endptr, &endptr, 10);
+                if (old_line_no > 0)
+                    map.push_back(std::make_pair(old_line_no, new_line_no));
+            }
+            std::sort(map.begin(), map.end());
+            map.erase(std::unique(map.begin(), map.end(),
+                [](const RENUM_LINE_MAP::value_type& a, const RENUM_LINE_MAP::value_type& b) {
+                    return a.first == b.first;
+                }), map.end());
+            if (!RENUM_line_map_image(map, m_image))
+                return false;
+            data = m_image.c_str();
+            size = m_image.size();
+        }
+
+        // the slot count is a power of two by its log2, and one slot at least is empty
+        m_bits = uint32_t(RENUM_get_le(&data[12], 4));
+        if (RENUM_get_le(&data[8], 4) != RENUM_MAP_VERSION || m_bits < 1 || m_bits > 31 ||
+            size < RENUM_MAP_HEADER_SIZE + (size_t(1) << m_bits) * RENUM_MAP_SLOT_SIZE ||
+            RENUM_get_le(&data[16], 8) >= (uint64_t(1) << m_bits))
+        {
+            return false;
+        }
+        m_slots = &data[RENUM_MAP_HEADER_SIZE];
+        return true;
+    }
+
+    bool find(uint32_t old_line_no, uint32_t& new_line_no) const
+    {
+        // the probes are limited for the broken map without any empty slot
+        size_t mask = (size_t(1) << m_bits) - 1;
+        size_t slot = RENUM_map_slot(old_line_no, m_bits);
+        for (size_t cProbes = 0; cProbes <= mask; ++cProbes, slot = (slot + 1) & mask)
+        {
+            uint32_t number = uint32_t(RENUM_get_le(&m_slots[slot * RENUM_MAP_SLOT_SIZE], 4));
+            if (number == 0)
+                return false;
+            if (number == old_line_no)
+            {
+                new_line_no = uint32_t(RENUM_get_le(&m_slots[slot * RENUM_MAP_SLOT_SIZE + 4], 4));
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+inline bool RENUM_is_word_char(char ch)
+{
+    return vsk_isalnum(ch) || ch == '_';
+}
+
+// is the number at ich after the word "in", "line" or "at"?
+bool RENUM_is_after_line_word(const char *str, size_t ich)
+{
+    size_t ichEnd = ich;
+    while (ichEnd > 0 && vsk_isblank(str[ichEnd - 1]))
+        --ichEnd;
+    if (ichEnd == ich)
+        return false;
+
+    size_t ichBegin = ichEnd;
+    while (ichBegin > 0 && vsk_isalpha(str[ichBegin - 1]))
+        --ichBegin;
+    if (ichBegin > 0 && RENUM_is_word_char(str[ichBegin - 1]))
+        return false;
+
+    std::string word(str + ichBegin, ichEnd - ichBegin);
+    vsk_upper(word);
+    return word == "IN" || word == "LINE" || word == "AT";
+}
+
+// translate the line numbers in the text
+void
+RENUM_translate_text(
+    const RENUM_LINE_MAP_VIEW& view,
+    const char *str,
+    size_t len,
+    std::string& out,
+    bool all_numbers)
+{
+    size_t ichCopied = 0;
+    for (size_t ich = 0; ich < len; )
+    {
+        if (!vsk_isdigit(str[ich]))
+        {
+            // skip the word
+            if (RENUM_is_word_char(str[ich]))
+            {
+                while (ich < len && RENUM_is_word_char(str[ich]))
+                    ++ich;
+            }
+            else
+            {
+                ++ich;
+            }
+            continue;
+        }
+
+        size_t ichBegin = ich;
+        uint64_t number = 0;
+        for (; ich < len && vsk_isdigit(str[ich]); ++ich)
+            number = std::min<uint64_t>(number * 10 + (str[ich] - '0'), 0x100000000);
+
+        // a whole number not in a decimal nor a word
+        if (ich < len && (RENUM_is_word_char(str[ich]) ||
+                          (str[ich] == '.' && ich + 1 < len && vsk_isdigit(str[ich + 1]))))
+        {
+            while (ich < len && RENUM_is_word_char(str[ich]))
+                ++ich;
+            continue;
+        }
+        if (ichBegin >= 2 && str[ichBegin - 1] == '.' && vsk_isdigit(str[ichBegin - 2]))
+            continue;
+        if (number == 0 || number > 0xFFFFFFFF)
+            continue;
+        if (!all_numbers && !RENUM_is_after_line_word(str, ichBegin))
+            continue;
+
+        uint32_t new_line_no;
+        if (!view.find(uint32_t(number), new_line_no) || new_line_no == number)
+            continue;
+
+        out.append(str + ichCopied, ichBegin - ichCopied);
+        out += std::to_string(new_line_no);
+        ichCopied = ich;
+    }
+    out.append(str + ichCopied, len - ichCopied);
+}
+
+#define RENUM_TRANSLATE_CHUNK (1024 * 1024)
+
+// translate the line numbers in a log file by the line map
+renum_error_t
+RENUM_translate_file(
+    const std::string& map_filename,
+    const std::string& in_filename,
+    const std::string& out_filename,
+    bool all_numbers,
+    bool sync)
+{
+    RENUM_LINE_MAP_VIEW view;
+    if (!view.load(map_filename))
+    {
+        std::fprintf(stderr, "renum: error: Unable to load line map '%s'\n", map_filename.c_str());
+        return 1;
+    }
+
+    FILE *fin = (in_filename == "-") ? stdin : RENUM_fopen_input(in_filename);
+    if (!fin)
+    {
+        std::fprintf(stderr, "renum: error: Unable to open file '%s'\n", in_filename.c_str());
+        return 1;
+    }
+
+    std::string tmp_filename;
+    FILE *fout = (out_filename == "-") ? stdout : RENUM_open_output(out_filename, tmp_filename);
+    if (!fout)
+    {
+        if (fin != stdin)
+            std::fclose(fin);
+        return 1;
+    }
+
+    // translate the complete lines of each chunk
+    std::vector<char> buf(RENUM_TRANSLATE_CHUNK);
+    std::string pending, out;
+    bool ok = true;
+    for (;;)
+    {
+        size_t size = std::fread(buf.data(), 1, buf.size(), fin);
+        pending.append(buf.data(), size);
+
+        size_t cut = pending.size();
+        if (size)
+        {
+            cut = pending.rfind('\n') + 1;
+            if (cut == 0)
+            {
+                if (pending.size() < RENUM_TRANSLATE_CHUNK)
+                    continue;
+
+                // a very long line is cut at a blank
+                cut = pending.find_last_of(" \t") + 1;
+                if (cut == 0)
+                    cut = pending.size();
+            }
+        }
+
+        out.clear();
+        RENUM_translate_text(view, pending.c_str(), cut, out, all_numbers);
+        pending.erase(0, cut);
+        if (out.size() && std::fwrite(out.c_str(), out.size(), 1, fout) != 1)
+            ok = false;
+
+        if (!size || !ok)
+            break;
+    }
+    if (std::ferror(fin))
+        ok = false;
+
+    if (fin != stdin)
+        std::fclose(fin);
+
+    if (fout == stdout)
+    {
+        if (std::fflush(stdout) != 0 || !ok)
+        {
+            std::fprintf(stderr, "renum: error: Unable to write file '%s'\n", out_filename.c_str());
+            return 1;
+        }
+        return 0;
+    }
+    return RENUM_close_output(fout, out_filename, tmp_filename, sync, ok);
+}
+
+void RENUM_C_default_options(RENUM_C_OPTIONS *options)
+{
+    options->new_start = RENUM_LINENO_START;
+    options->old_start = 0;
+    options->step = RENUM_LINENO_STEP;
+    options->force = 0;
+    options->encoding = RENUM_C_ENCODING_AUTO;
+}
+
+// restores the encoding and the quietness of the thread on every exit
+struct RENUM_C_STATE_GUARD
+{
+    RENUM_ENCODING m_encoding;
+    bool m_quiet;
+
+    RENUM_C_STATE_GUARD() : m_encoding(RENUM_get_encoding()), m_quiet(s_renum_quiet)
+    {
+    }
+    ~RENUM_C_STATE_GUARD()
+    {
+        RENUM_set_encoding(m_encoding);
+        s_renum_quiet = m_quiet;
+    }
+};
+
+// the physical line index (1-based) of the first line having the line number
+size_t RENUM_C_physical_line(const char *input, size_t input_len, renum_lineno_t lineno)
+{
+    size_t iLine = 1;
+    for (const char *p = input, *end = input + input_len; p < end; ++iLine)
+    {
+        auto next = static_cast<const char *>(std::memchr(p, '\n', end - p));
+        if (!next)
+            next = end;
+        if (RENUM_line_number_from_line_text(std::string(p, next)) == lineno)
+            return iLine;
+        p = next + 1;
+    }
+    return 0;
+}
+
+// split the input into the lines as the text functions do
+void RENUM_C_split_lines(const char *input, size_t input_len, std::vector<std::string>& lines)
+{
+    // trim the space of right side
+    while (input_len && std::memchr(" \t\r\n", input[input_len - 1], 4))
+        --input_len;
+
+    lines.clear();
+    for (const char *p = input, *end = input + input_len; ; )
+    {
+        auto next = static_cast<const char *>(std::memchr(p, '\n', end - p));
+        if (!next)
+        {
+            lines.emplace_back(p, end);
+            break;
+        }
+        lines.emplace_back(p, next);
+        p = next + 1;
+    }
+}
+
+// the common part of the C interface
+template <typename T_FN>
+int
+RENUM_C_call(
+    const char *input,
+    size_t input_len,
+    char *output,
+    size_t output_size,
+    size_t *output_len,
+    const RENUM_C_OPTIONS *options,
+    RENUM_C_ERROR *error,
+    T_FN fn)
+{
+    RENUM_C_ERROR dummy_error;
+    if (!error)
+        error = &dummy_error;
+    *error = RENUM_C_ERROR { RENUM_C_OK, 0, 0, 0, 0 };
+
+    RENUM_C_OPTIONS default_options;
+    if (!options)
+    {
+        RENUM_C_default_options(&default_options);
+        options = &default_options;
+    }
+
+    if ((!input && input_len) || (!output && output_size) || !output_len ||
+        options->step <= 0 || options->encoding < RENUM_C_ENCODING_ASCII ||
+        options->encoding > RENUM_C_ENCODING_AUTO)
+    {
+        error->code = RENUM_C_E_INVALID_ARGUMENT;
+        return error->code;
+    }
+    *output_len = 0;
+
+    try
+    {
+        bool bom = (input_len >= 3 && std::memcmp(input, UTF8_BOM, 3) == 0);
+        const char *body = bom ? input + 3 : input;
+        size_t body_len = bom ? input_len - 3 : input_len;
+
+        RENUM_C_STATE_GUARD guard;
+        if (options->encoding == RENUM_C_ENCODING_AUTO)
+            RENUM_set_encoding(RENUM_detect_encoding(body, body_len, bom));
+        else
+            RENUM_set_encoding(RENUM_ENCODING(options->encoding));
+
+        std::vector<std::string> lines;
+        RENUM_C_split_lines(body, body_len, lines);
+
+        // no messages to stderr
+        s_renum_error = RENUM_ERROR_INFO { RENUM_ERR_NONE, 0, 0, 0, 0 };
+        s_renum_quiet = true;
+        if (fn(lines, *options))
+        {
+            auto& info = RENUM_get_last_error();
+            *error = RENUM_C_ERROR { info.code, info.line, info.column, info.lineno, info.target };
+            if (!error->code)
+                error->code = RENUM_C_E_INVALID_ARGUMENT;
+
+            // the lines may be sorted
+            if (error->code == RENUM_C_E_UNDEFINED_LINE && error->lineno)
+                error->line = RENUM_C_physical_line(input, input_len, error->lineno);
+            return error->code;
+        }
+
+        // the same text as RENUM_join_lines, rendered into the buffer
+        size_t size = (bom ? 3 : 0) + lines.size() - 1;
+#ifdef RENUM_APPEND_NEWLINE
+        ++size;
+#endif
+        for (auto& line : lines)
+            size += line.size();
+        *output_len = size;
+        if (output_size < size)
+        {
+            error->code = RENUM_C_E_BUFFER_TOO_SMALL;
+            return error->code;
+        }
+
+        char *ptr = output;
+        if (bom)
+        {
+            std::memcpy(ptr, UTF8_BOM, 3);
+            ptr += 3;
+        }
+        for (auto& line : lines)
+        {
+            if (&line != &lines[0])
+                *ptr++ = '\n';
+            std::memcpy(ptr, line.c_str(), line.size());
+            ptr += line.size();
+        }
+#ifdef RENUM_APPEND_NEWLINE
+        *ptr++ = '\n';
+#endif
+    }
+    catch (const std::bad_alloc&)
+    {
+        error->code = RENUM_C_E_OUT_OF_MEMORY;
+        return error->code;
+    }
+
+    return RENUM_C_OK;
+}
+
+int RENUM_C_renumber_lines(
+    const char *input,
+    size_t input_len,
+    char *output,
+    size_t output_size,
+    size_t *output_len,
+    const RENUM_C_OPTIONS *options,
+    RENUM_C_ERROR *error)
+{
+    return RENUM_C_call(input, input_len, output, output_size, output_len, options, error,
+        [](std::vector<std::string>& lines, const RENUM_C_OPTIONS& options) {
+            RENUM_sort_lines(lines);
+
+            // the blank lines sorted to the end are trimmed as the text
+            while (lines.size() > 1 && lines.back().find_first_not_of(" \t\r") == lines.back().npos)
+                lines.pop_back();
+
+            return RENUM_renumber_split_lines(lines, options.new_start, options.old_start, options.step,
+                                              !!options.force);
+        }
+    );
+}
+
+int RENUM_C_add_line_numbers(
+    const char *input,
+    size_t input_len,
+    char *output,
+    size_t output_size,
+    size_t *output_len,
+    const RENUM_C_OPTIONS *options,
+    RENUM_C_ERROR *error)
+{
+    return RENUM_C_call(input, input_len, output, output_size, output_len, options, error,
+        [](std::vector<std::string>& lines, const RENUM_C_OPTIONS& options) {
+            return RENUM_add_split_line_numbers(lines, options.new_start, options.step, !!options.force);
+        }
+    );
+}
+
+void RENUM_C_tests(void)
+{
+    const char *input = "100 GOTO 110\n110 END\n";
+    size_t len = 0;
+    RENUM_C_ERROR error;
+    char buf[32];
+    assert(RENUM_C_renumber_lines(input, std::strlen(input), nullptr, 0, &len, nullptr, &error) == RENUM_C_E_BUFFER_TOO_SMALL);
+    assert(len == 18);
+    assert(RENUM_C_renumber_lines(input, std::strlen(input), buf, len, &len, nullptr, &error) == RENUM_C_OK);
+    assert(std::string(buf, len) == "10 GOTO 20\n20 END\n");
+
+    input = "100 GOTO 110\n110 GOTO 120\n";
+    assert(RENUM_C_renumber_lines(input, std::strlen(input), buf, sizeof(buf), &len, nullptr, &error) == RENUM_C_E_UNDEFINED_LINE);
+    assert(error.lineno == 110 && error.target == 120 && error.column == 10 && error.line == 2);
+
+    input = "20 GOTO 99\n10 END\n";
+    assert(RENUM_C_renumber_lines(input, std::strlen(input), buf, sizeof(buf), &len, nullptr, &error) == RENUM_C_E_UNDEFINED_LINE);
+    assert(error.lineno == 20 && error.line == 1);
+
+    input = "\xEF\xBB\xBF" "20 END\n10 GOTO 20\n\n \n";
+    assert(RENUM_C_renumber_lines(input, std::strlen(input), buf, sizeof(buf), &len, nullptr, &error) == RENUM_C_OK);
+    assert(std::string(buf, len) == "\xEF\xBB\xBF" "10 GOTO 20\n20 END\n");
+
+    input = "PRINT\nEND\n";
+    assert(RENUM_C_add_line_numbers(input, std::strlen(input), buf, 8, &len, nullptr, &error) == RENUM_C_E_BUFFER_TOO_SMALL);
+    assert(len == 16);
+    assert(RENUM_C_add_line_numbers(input, std::strlen(input), buf, len, &len, nullptr, &error) == RENUM_C_OK);
+    assert(std::string(buf, len) == "10 PRINT\n20 END\n");
+
+    RENUM_C_OPTIONS options;
+    RENUM_C_default_options(&options);
+    options.encoding = 42;
+    assert(RENUM_C_renumber_lines(input, std::strlen(input), buf, sizeof(buf), &len, &options, &error) == RENUM_C_E_INVALID_ARGUMENT);
+}
+
+void RENUM_prefilter_tests(void)
+{
+    const char *lines[] =
+    {
+        "PRINT \"HELLO\"", "A=B+C:D=E*F", "DATA 1,2,3", "",
+        "GOTO 10", "on x go to 10", "IF A THEN 20", "resume", "X=1:RETURN 10",
+        "PRINT \"ABCDEFGHIJKLMNOPQRSTUVWXYZ\":LList 10-20",
+        "PRINT 1234567890123456789012345:PRINT 123456789012:eLsE",
+    };
+    for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); ++i)
+        assert(RENUM_may_refer_line_numbers(lines[i], std::strlen(lines[i])) == (i >= 4));
+
+    std::string text = "10 PRINT 20:A=30\n20 GOTO 10\n";
+    assert(RENUM_renumber_lines(text, 100, 0, 10) == 0);
+    assert(text == "100 PRINT 20:A=30\n110 GOTO 100\n");
+}
+
+void RENUM_line_map_tests(void)
+{
+    RENUM_LINE_MAP map = { { 10, 100 }, { 20, 110 }, { 30, 120 } };
+    RENUM_LINE_MAP_VIEW view;
+    assert(RENUM_line_map_image(map, view.m_image));
+    view.m_bits = uint32_t(RENUM_get_le(&view.m_image[12], 4));
+    view.m_slots = &view.m_image[RENUM_MAP_HEADER_SIZE];
+
+    uint32_t number;
+    assert(view.find(20, number) && number == 110);
+    assert(!view.find(40, number));
+
+    std::string text = "Error in 20 at 30, 10 items at 1.10 LINE 10\n", out;
+    RENUM_translate_text(view, text.c_str(), text.size(), out, false);
+    assert(out == "Error in 110 at 120, 10 items at 1.10 LINE 100\n");
+
+    // the broken map without any empty slot
+    size_t cSlots = size_t(1) << view.m_bits;
+    for (size_t slot = 0; slot < cSlots; ++slot)
+        RENUM_put_le(&view.m_image[RENUM_MAP_HEADER_SIZE + slot * RENUM_MAP_SLOT_SIZE], 1000 + slot, 4);
+    assert(!view.find(40, number));
+
+#ifndef _WIN32
+    const char *tmpdir = std::getenv("TMPDIR");
+    std::string filename = std::string((tmpdir && *tmpdir) ? tmpdir : "/tmp") +
+                           "/renum-test" + std::to_string(::getpid()) + ".map";
+    RENUM_put_le(&view.m_image[16], cSlots, 8);
+    RENUM_SEGMENT segment = { view.m_image.c_str(), view.m_image.size() };
+    assert(RENUM_save_segments(filename, &segment, 1, false) == 0);
+    RENUM_LINE_MAP_VIEW broken;
+    assert(!broken.load(filename));
+    std::remove(filename.c_str());
+#endif
+}
+
+void RENUM_hash_tests(void)
+{
+    const char *data = "10 PRINT \"HELLO\":GOTO 10\n";
+    size_t size = std::strlen(data);
+    uint64_t hash = RENUM_hash(data, size, 7);
+    for (size_t chunk = 1; chunk <= 9; ++chunk)
+    {
+        RENUM_HASH_STATE state;
+        RENUM_hash_init(state, 7);
+        for (size_t i = 0; i < size; i += chunk)
+            RENUM_hash_update(state, data + i, std::min(chunk, size - i));
+        assert(RENUM_hash_final(state) == hash);
+    }
+    assert(RENUM_hash(data, size - 1, 7) != hash);
+}
+
+void RENUM_compression_tests(void)
+{
+#if defined(RENUM_HAVE_COMPRESSION) && defined(RENUM_HAVE_ZLIB)
+    const char *tmpdir = std::getenv("TMPDIR");
+    std::string base = std::string((tmpdir && *tmpdir) ? tmpdir : "/tmp") +
+                       "/renum-test" + std::to_string(::getpid());
+    std::string gz = base + ".bas.gz", part = base + "-part.bas.gz", tmp_filename;
+
+    // read the whole file by RENUM_fopen_input (false on error)
+    auto read_all = [](const std::string& filename, std::string& text) {
+        text.clear();
+        FILE *fin = RENUM_fopen_input(filename);
+        if (!fin)
+            return false;
+        char buf[256];
+        size_t size;
+        while ((size = std::fread(buf, 1, sizeof(buf), fin)) > 0)
+            text.append(buf, size);
+        bool ok = !std::ferror(fin);
+        std::fclose(fin);
+        return ok;
+    };
+
+    // the round trip
+    std::string text, data;
+    for (int i = 1; i <= 2000; ++i)
+        text += std::to_string(i * 10) + " PRINT " + std::to_string(i) + "\n";
+    FILE *fout = RENUM_open_output(gz, tmp_filename);
+    assert(fout);
+    assert(std::fputs(text.c_str(), fout) >= 0);
+    assert(RENUM_close_output(fout, gz, tmp_filename, false, true) == 0);
+    assert(read_all(gz, data) && data == text);
+
+    // the truncated stream
+    FILE *fin = fopen(gz.c_str(), "rb");
+    assert(fin);
+    char buf[64 * 1024];
+    size_t size = std::fread(buf, 1, sizeof(buf), fin);
+    std::fclose(fin);
+    FILE *fp = fopen(part.c_str(), "wb");
+    assert(fp && size > 16);
+    std::fwrite(buf, 1, size / 2, fp);
+    std::fclose(fp);
+    assert(!read_all(part, data));
+
+    // the multiple members
+    gzFile gzf = gzopen(gz.c_str(), "wb");
+    assert(gzf && gzputs(gzf, "10 A\n") > 0 && gzclose(gzf) == Z_OK);
+    gzf = gzopen(gz.c_str(), "ab");
+    assert(gzf && gzputs(gzf, "20 B\n") > 0 && gzclose(gzf) == Z_OK);
+    assert(read_all(gz, data) && data == "10 A\n20 B\n");
+
+    // the zero padding after the members
+    fp = fopen(gz.c_str(), "ab");
+    assert(fp);
+    std::fwrite(std::string(512, '\0').c_str(), 1, 512, fp);
+    std::fclose(fp);
+    assert(read_all(gz, data) && data == "10 A\n20 B\n");
+
+    std::remove(gz.c_str());
+    std::remove(part.c_str());
+#endif
+}
+
+void RENUM_merge_tests(void)
+{
+    // the encoding scanned line by line agrees with the whole text
+    {
+        RENUM_ENCODING_SCANNER scanner;
+        scanner.scan("10 END");
+        assert(scanner.encoding(false) == RENUM_ENCODING_ASCII);
+        scanner.scan("20 PRINT \"\xE3\x81\x82\"");
+        assert(scanner.encoding(false) == RENUM_ENCODING_UTF8);
+        scanner.scan("30 PRINT \"\x82\xA0\"");
+        assert(scanner.encoding(false) == RENUM_ENCODING_SJIS);
+        assert(scanner.encoding(true) == RENUM_ENCODING_UTF8);
+    }
+
+#ifndef _WIN32
+    const char *tmpdir = std::getenv("TMPDIR");
+    std::string base = std::string((tmpdir && *tmpdir) ? tmpdir : "/tmp") +
+                       "/renum-test" + std::to_string(::getpid());
+    std::string in_filename = base + "-in.bas", out_filename = base + "-out.bas";
+
+    // the unsorted lines of one run each, merged by three runs at most in several passes
+    std::string text;
+    for (int i = 0; i < 100; ++i)
+    {
+        int number = (i * 37) % 100 + 1;
+        text += std::to_string(number * 10) + " PRINT " + std::to_string(number) + ":GOTO " +
+                std::to_string((number % 100 + 1) * 10) + "\n";
+    }
+    RENUM_SEGMENT segment = { text.c_str(), text.size() };
+    assert(RENUM_save_segments(in_filename, &segment, 1, false) == 0);
+    assert(RENUM_renumber_file_by_runs(in_filename, out_filename, 1, 3, 100, 0, 5, false, false, false) == 0);
+
+    std::string expected = text, data;
+    assert(RENUM_renumber_text(expected, 100, 0, 5, false) == 0);
+    bool bom = false;
+    assert(RENUM_load_file(out_filename, data, bom) == 0 && data == expected);
+
+    std::remove(in_filename.c_str());
+    std::remove(out_filename.c_str());
+#endif
+}
+
+void RENUM_project_tests(void)
+{
+    // the errors of the workers are given to the calling thread
+    std::vector<RENUM_PROJECT_FILE> files(8);
+    for (size_t iFile = 0; iFile < files.size(); ++iFile)
+    {
+        files[iFile].filename = "FILE" + std::to_string(iFile);
+        files[iFile].text = std::to_string((iFile + 1) * 100) + " GOTO " + std::to_string((iFile + 1) * 100) + "\n";
+    }
+    files[5].text = "600 GOTO 999\n";
+    RENUM_set_quiet(true);
+    assert(RENUM_renumber_project(files, 10, 0, 10, false) == 1);
+    RENUM_set_quiet(false);
+    auto& info = RENUM_get_last_error();
+    assert(info.code == RENUM_ERR_UNDEFINED_LINE && info.lineno == 600 && info.target == 999);
+}
+
+void RENUM_check_tests(void)
+{
+    RENUM_CHECK_RESULT result;
+    {
+        std::string text = "10 GOTO 20\n20 END\n";
+        assert(RENUM_check_lines(text, result) == 0);
+        assert(result.canonical);
+    }
+    {
+        std::string text = "10 GOTO 30\n30 END\n";
+        assert(RENUM_check_lines(text, result) == 0);
+        assert(!result.canonical);
+    }
+    {
+        // the output of renum itself
+        std::string text = "10 PRINT\n20 \n30 GOTO 10\n";
+        assert(RENUM_check_lines(text, result) == 0);
+        assert(result.canonical);
+        text = "10 GOTO 20\n20 \n";
+        assert(RENUM_check_lines(text, result) == 0);
+        assert(result.canonical);
+        text = "10 PRINT \n20 END\n";
+        assert(RENUM_check_lines(text, result) == 0);
+        assert(!result.canonical);
+    }
+    {
+        std::string text = "20 GOTO 40\n10 END\n10 PRINT\n";
+        assert(RENUM_check_lines(text, result) == 1);
+        assert(result.unsorted.size() == 1 && result.unsorted[0] == 10);
+        assert(result.duplicated.size() == 1 && result.duplicated[0] == 10);
+        assert(result.undefined.size() == 1 && result.undefined[0].second == 40);
+        assert(RENUM_check_lines(text, result, 10, 0, 10, true) == 1);
+        assert(result.unsorted.size() == 1 && result.duplicated.empty());
+    }
+}
+
+void RENUM_edits_tests(void)
+{
+    {
+        std::vector<RENUM_EDIT> edits;
+        std::string text = "10 A\n20 GOTO 30\n30 B\n40 C\n";
+        std::vector<RENUM_GAP> gaps = { RENUM_GAP { 20, 15 } };
+        assert(RENUM_renumber_minimal(text, edits, gaps) == 0);
+        RENUM_apply_edits(text, edits);
+        assert(text == "10 A\n14 GOTO 30\n30 B\n40 C\n");
+
+        text = "10 A\n30 B\n20 C\n40 D\n";
+        assert(RENUM_renumber_minimal(text, edits, std::vector<RENUM_GAP>()) == 0);
+        assert(edits.size() == 1);
+    }
+
+    std::vector<RENUM_EDIT> edits;
+    std::string text = "100 GOTO 110\n110 END\n", renumbered = text;
+    assert(RENUM_renumber_edits(text, edits) == 0);
+    assert(edits.size() == 3);
+    assert(edits[1].offset == 9 && edits[1].old_text == "110" && edits[1].new_text == "20");
+    RENUM_apply_edits(text, edits);
+    assert(RENUM_renumber_lines(renumbered) == 0);
+    assert(text == renumbered);
+
+    // normalized as RENUM_renumber_lines
+    text = renumbered = "  100 GOTO 110 \r\n110END\r\n120\r\n\r\n";
+    assert(RENUM_renumber_edits(text, edits) == 0);
+    RENUM_apply_edits(text, edits);
+    assert(RENUM_renumber_lines(renumbered) == 0);
+    assert(text == renumbered);
+
+    std::string diff;
+    RENUM_unified_diff(diff, "a.bas", "10 A\n\n", std::vector<RENUM_EDIT> { RENUM_EDIT { 5, "\n", "" } });
+    assert(diff == "--- a.bas\n+++ a.bas\n@@ -1,2 +1,1 @@\n 10 A\n-\n");
+}
+
+#ifdef RENUM_EXE
+
+// parse command line
+renum_error_t RENUM_parse_cmdline(RENUM& renum, int argc, char **argv)
+{
+    renum.m_options.clear();
+    renum.m_options["-o"] = RENUM_DEFAULT_OUTPUT;
+    renum.m_inputs.clear();
+    bool output_specified = false;
+
+    for (int iarg = 1; iarg < argc; ++iarg)
+    {
+        std::string arg = argv[iarg];
+        if (arg == "--help" || arg == "/?")
+        {
+            RENUM_usage();
+            return -1;
+        }
+        if (arg == "--version")
+        {
+            RENUM_version();
+            return -1;
+        }
+        if (arg == "--force")
+        {
+            renum.m_force = true;
+            continue;
+        }
+        if (arg == "--check")
+        {
+            renum.m_check = true;
+            continue;
+        }
+        if (arg == "--fail-fast")
+        {
+            renum.m_fail_fast = true;
+            continue;
+        }
+        if (arg == "--diff")
+        {
+            renum.m_diff = true;
+            continue;
+        }
+        if (arg == "--edits")
         {
-            RENUM_usage();
-            return -1;
+            renum.m_edits = true;
+            continue;
         }
-        if (arg == "--version")
+        if (arg == "--sync")
         {
-            RENUM_version();
-            return -1;
+            renum.m_sync = true;
+            continue;
         }
-        if (arg == "--force")
+        if (arg == "--minimal")
         {
-            renum.m_force = true;
+            renum.m_minimal = true;
+            continue;
+        }
+        if (arg == "--cache-stats")
+        {
+            renum.m_cache_stats = true;
             continue;
         }
         if (arg == "-i" || arg == "-o" ||
             arg == "--old-start" ||
             arg == "--new-start" ||
-            arg == "--step")
+            arg == "--step" ||
+            arg == "--memory-limit" ||
+            arg == "--jobs" ||
+            arg == "--encoding" ||
+            arg == "--cache" ||
+            arg == "--gap" ||
+            arg == "--cache-size" ||
+            arg == "--batch" ||
+            arg == "--io" ||
+            arg == "--map" ||
+            arg == "--map-text" ||
+            arg == "--journal")
         {
             if (iarg + 1 < argc)
             {
                 ++iarg;
-                renum.m_options[arg] = argv[iarg];
+                if (arg == "-i")
+                    renum.m_inputs.push_back(argv[iarg]);
+                if (arg == "-o")
+                    output_specified = true;
+                if (arg != "-i" || renum.m_inputs.size() == 1)
+                    renum.m_options[arg] = argv[iarg];
                 continue;
             }
             else
@@ -700,6 +5502,159 @@ renum_error_t RENUM_parse_cmdline(RENUM& renum, int argc, char **argv)
         }
     }
 
+    auto it5 = renum.m_options.find("--memory-limit");
+    if (it5 != renum.m_options.end())
+    {
+        char *endptr;
+        unsigned long mb = std::strtoul(it5->second.c_str(), &endptr, 10);
+        if (*endptr || mb <= 0)
+        {
+            std::fprintf(stderr, "renum: error: --memory-limit '%s' is not a positive integer\n", it5->second.c_str());
+            return 1;
+        }
+        renum.m_memory_limit = size_t(mb) * 1024 * 1024;
+    }
+
+    auto it6 = renum.m_options.find("--jobs");
+    if (it6 != renum.m_options.end())
+    {
+        char *endptr;
+        renum.m_jobs = std::strtoul(it6->second.c_str(), &endptr, 10);
+        if (*endptr || renum.m_jobs <= 0)
+        {
+            std::fprintf(stderr, "renum: error: --jobs '%s' is not a positive integer\n", it6->second.c_str());
+            return 1;
+        }
+    }
+
+    auto it7 = renum.m_options.find("--encoding");
+    if (it7 != renum.m_options.end())
+    {
+        std::string encoding = it7->second;
+        vsk_upper(encoding);
+        renum.m_auto_encoding = false;
+        if (encoding == "AUTO")
+            renum.m_auto_encoding = true;
+        else if (encoding == "SJIS" || encoding == "SHIFT_JIS" || encoding == "CP932")
+            RENUM_set_encoding(RENUM_ENCODING_SJIS);
+        else if (encoding == "UTF8" || encoding == "UTF-8")
+            RENUM_set_encoding(RENUM_ENCODING_UTF8);
+        else if (encoding == "ASCII")
+            RENUM_set_encoding(RENUM_ENCODING_ASCII);
+        else
+        {
+            std::fprintf(stderr, "renum: error: --encoding '%s' is not supported\n", it7->second.c_str());
+            return 1;
+        }
+    }
+
+    auto it10 = renum.m_options.find("--gap");
+    if (it10 != renum.m_options.end())
+    {
+        std::vector<std::string> items;
+        mstr_split(items, it10->second, ",");
+        for (auto& item : items)
+        {
+            char *endptr;
+            RENUM_GAP gap;
+            gap.after = std::strtoul(item.c_str(), &endptr, 10);
+            if (*endptr == ':')
+                gap.count = std::strtoul(endptr + 1, &endptr, 10);
+            if (*endptr || item.find(':') == item.npos || gap.after <= 0)
+            {
+                std::fprintf(stderr, "renum: error: --gap '%s' is not in the form of LINE:COUNT\n", item.c_str());
+                return 1;
+            }
+            renum.m_gaps.push_back(gap);
+        }
+        renum.m_minimal = true;
+    }
+
+    auto it8 = renum.m_options.find("--cache");
+    if (it8 != renum.m_options.end())
+        renum.m_cache_dir = it8->second;
+
+    auto it9 = renum.m_options.find("--cache-size");
+    if (it9 != renum.m_options.end())
+    {
+        char *endptr;
+        unsigned long mb = std::strtoul(it9->second.c_str(), &endptr, 10);
+        if (*endptr || mb <= 0)
+        {
+            std::fprintf(stderr, "renum: error: --cache-size '%s' is not a positive integer\n", it9->second.c_str());
+            return 1;
+        }
+        renum.m_cache_size = mb * 1024ULL * 1024;
+    }
+
+    if (renum.m_cache_stats)
+    {
+        if (renum.m_cache_dir.empty())
+        {
+            std::fprintf(stderr, "renum: error: No cache directory specified\n");
+            return 1;
+        }
+        RENUM_CACHE_STATS stats;
+        RENUM_cache_stats(renum.m_cache_dir, stats);
+        std::printf("hits: %llu\nmisses: %llu\nentries: %llu\nsize: %llu\n",
+                    stats.hits, stats.misses, stats.entries, stats.size);
+        return -1;
+    }
+
+    auto it11 = renum.m_options.find("--io");
+    if (it11 != renum.m_options.end())
+    {
+        if (it11->second == "auto")
+            renum.m_io_engine = RENUM_IO_AUTO;
+        else if (it11->second == "uring")
+            renum.m_io_engine = RENUM_IO_URING;
+        else if (it11->second == "threads")
+            renum.m_io_engine = RENUM_IO_THREADS;
+        else
+        {
+            std::fprintf(stderr, "renum: error: --io '%s' is not supported\n", it11->second.c_str());
+            return 1;
+        }
+    }
+
+    auto it13 = renum.m_options.find("--map");
+    if (it13 != renum.m_options.end())
+        renum.m_map_file = it13->second;
+
+    auto it14 = renum.m_options.find("--map-text");
+    if (it14 != renum.m_options.end())
+        renum.m_map_text_file = it14->second;
+
+    if ((renum.m_map_file.size() || renum.m_map_text_file.size()) &&
+        (renum.m_inputs.size() > 1 || renum.m_check || renum.m_minimal))
+    {
+        std::fprintf(stderr, "renum: error: --map cannot be used with multiple inputs, --check or --minimal\n");
+        return 1;
+    }
+
+    auto it12 = renum.m_options.find("--batch");
+    if (it12 != renum.m_options.end())
+    {
+        if (renum.m_inputs.size() || output_specified || renum.m_check || renum.m_diff || renum.m_edits ||
+            renum.m_minimal || renum.m_memory_limit || renum.m_map_file.size() || renum.m_map_text_file.size())
+        {
+            std::fprintf(stderr, "renum: error: --batch cannot be used with the other inputs or modes\n");
+            return 1;
+        }
+        renum.m_batch = it12->second;
+
+        auto it15 = renum.m_options.find("--journal");
+        if (it15 != renum.m_options.end())
+            renum.m_journal = it15->second;
+        return 0;
+    }
+
+    if (renum.m_options.count("--journal"))
+    {
+        std::fprintf(stderr, "renum: error: --journal needs --batch\n");
+        return 1;
+    }
+
     auto it3 = renum.m_options.find("-i");
     if (it3 == renum.m_options.end())
     {
@@ -708,6 +5663,20 @@ renum_error_t RENUM_parse_cmdline(RENUM& renum, int argc, char **argv)
         return 1;
     }
 
+    if (renum.m_inputs.size() > 1)
+    {
+        if (output_specified || renum.m_check || renum.m_diff || renum.m_edits)
+        {
+            std::fprintf(stderr, "renum: error: Multiple input files are renumbered in place\n");
+            return 1;
+        }
+        if (renum.m_minimal || renum.m_jobs || renum.m_memory_limit)
+        {
+            std::fprintf(stderr, "renum: error: Multiple input files cannot be used with --minimal, --jobs or --memory-limit\n");
+            return 1;
+        }
+    }
+
     auto it4 = renum.m_options.find("-o");
     if (it4 == renum.m_options.end())
     {
@@ -719,34 +5688,410 @@ renum_error_t RENUM_parse_cmdline(RENUM& renum, int argc, char **argv)
     return 0;
 }
 
-// the main part of this program / library
-renum_error_t RENUM_renum(RENUM& renum)
+// check the program and report
+renum_error_t RENUM_check(RENUM& renum, const std::string& text)
 {
-    std::string text;
-    renum_error_t error = RENUM_load_file(renum.m_options["-i"], text, renum.m_bom);
+    RENUM_CHECK_RESULT result;
+    renum_error_t error = RENUM_check_lines(text, result, renum.m_new_start, renum.m_old_start,
+                                            renum.m_step, renum.m_fail_fast);
+
+    for (auto& iLine : result.no_line_numbers)
+        RENUM_ERROR_MESSAGE("No line number found at line " + std::to_string(iLine) + "\n");
+    for (auto& number : result.unsorted)
+        RENUM_ERROR_MESSAGE("Unsorted line " + std::to_string(number) + "\n");
+    for (auto& number : result.duplicated)
+        RENUM_ERROR_MESSAGE("Duplicated line " + std::to_string(number) + "\n");
+    for (auto& pair : result.undefined)
+        RENUM_ERROR_MESSAGE("Undefined line " + std::to_string(pair.second) + " in " + std::to_string(pair.first) + "\n");
+
     if (error)
+        return 1;
+
+    if (!result.canonical)
+    {
+        std::printf("%s: to be renumbered\n", renum.m_options["-i"].c_str());
+        return 2;
+    }
+
+    std::printf("%s: already canonical\n", renum.m_options["-i"].c_str());
+    return 0;
+}
+
+// renumber by the edits and write the changes or the result
+renum_error_t RENUM_renum_edits(RENUM& renum, std::string& text)
+{
+    std::vector<RENUM_EDIT> edits;
+    renum_error_t error;
+    if (renum.m_minimal)
+        error = RENUM_renumber_minimal(text, edits, renum.m_gaps, renum.m_step, renum.m_force);
+    else
+        error = RENUM_renumber_edits(text, edits, renum.m_new_start, renum.m_old_start,
+                                     renum.m_step, renum.m_force);
+    if (error)
+    {
+        if (RENUM_get_last_error().code == RENUM_ERR_UNSORTED_LINE)
+            std::fprintf(stderr, "renum: error: Sort the lines by renum without --diff or --edits first\n");
         return error;
+    }
 
-    renum_lineno_t first_lineno = RENUM_line_number_from_line_text(text, nullptr);
-    if (first_lineno == 0)
+    if (!renum.m_diff && !renum.m_edits)
+    {
+        RENUM_apply_edits(text, edits);
+        return RENUM_save_file(renum.m_options["-o"], text, renum.m_bom, renum.m_sync);
+    }
+
+    // the offsets in the file
+    if (renum.m_bom)
+    {
+        text.insert(0, UTF8_BOM);
+        for (auto& edit : edits)
+            edit.offset += 3;
+    }
+
+    std::string output;
+    if (renum.m_diff)
+        RENUM_unified_diff(output, renum.m_options["-i"], text, edits);
+    else
+        RENUM_edit_list(output, edits);
+
+    return RENUM_save_file(renum.m_options["-o"], output, false, renum.m_sync);
+}
+
+// renumber the files sharing one line number space
+renum_error_t RENUM_renum_project(RENUM& renum)
+{
+    std::vector<RENUM_PROJECT_FILE> files(renum.m_inputs.size());
+    std::vector<char> boms(files.size());
+    for (size_t iFile = 0; iFile < files.size(); ++iFile)
     {
-        error = RENUM_add_line_numbers(text, renum.m_new_start, renum.m_step);
+        auto& file = files[iFile];
+        file.filename = renum.m_inputs[iFile];
+
+        bool bom = false;
+        renum_error_t error = RENUM_load_file(file.filename, file.text, bom);
         if (error)
             return error;
+        boms[iFile] = bom;
     }
-    else
+
+    if (renum.m_auto_encoding)
     {
-        RENUM_sort_by_line_numbers(text);
+        // UTF-8 if any file is UTF-8, Shift_JIS if any other is non-ASCII
+        RENUM_ENCODING encoding = RENUM_ENCODING_ASCII;
+        for (size_t iFile = 0; iFile < files.size(); ++iFile)
+        {
+            auto& text = files[iFile].text;
+            auto detected = RENUM_detect_encoding(text.c_str(), text.size(), !!boms[iFile]);
+            if (detected == RENUM_ENCODING_UTF8)
+            {
+                encoding = RENUM_ENCODING_UTF8;
+                break;
+            }
+            if (detected == RENUM_ENCODING_SJIS)
+                encoding = RENUM_ENCODING_SJIS;
+        }
+        RENUM_set_encoding(encoding);
+    }
+
+    renum_error_t error = RENUM_renumber_project(files, renum.m_new_start, renum.m_old_start,
+                                                 renum.m_step, renum.m_force);
+    if (error)
+        return error;
+
+    // write all the temporary files before replacing any file
+    std::vector<std::string> tmp_filenames(files.size());
+    for (size_t iFile = 0; iFile < files.size(); ++iFile)
+    {
+        auto& file = files[iFile];
+        FILE *fout = RENUM_open_output(file.filename, tmp_filenames[iFile]);
+        if (fout)
+        {
+            RENUM_SEGMENT segments[2];
+            size_t count = 0;
+            if (boms[iFile])
+                segments[count++] = RENUM_SEGMENT { UTF8_BOM, 3 };
+            segments[count++] = RENUM_SEGMENT { file.text.c_str(), file.text.size() };
+            bool ok = RENUM_write_segments(fout, segments, count);
+            error = RENUM_finish_output(fout, file.filename, tmp_filenames[iFile], renum.m_sync, ok);
+        }
+        if (!fout || error)
+        {
+            // leave all the files untouched
+            for (size_t iDone = 0; iDone < iFile; ++iDone)
+                std::remove(tmp_filenames[iDone].c_str());
+            return 1;
+        }
+    }
 
-        error = RENUM_renumber_lines(text, renum.m_new_start, renum.m_old_start, renum.m_step, renum.m_force);
+    for (size_t iFile = 0; iFile < files.size(); ++iFile)
+    {
+        auto& file = files[iFile];
+        error = RENUM_replace_output(file.filename, tmp_filenames[iFile], renum.m_sync);
         if (error)
+        {
+            for (size_t iRest = iFile + 1; iRest < files.size(); ++iRest)
+                std::remove(tmp_filenames[iRest].c_str());
             return error;
+        }
+        std::printf("%s: %lu-%lu\n", file.filename.c_str(), file.first, file.last);
+    }
+
+    return 0;
+}
+
+// the options affecting the cached result
+std::string RENUM_cache_options(RENUM& renum)
+{
+    std::string options = RENUM_VERSION;
+    options += " " + std::to_string(renum.m_new_start);
+    options += " " + std::to_string(renum.m_old_start);
+    options += " " + std::to_string(renum.m_step);
+    options += renum.m_force ? " force" : "";
+    options += renum.m_minimal ? " minimal" : "";
+    for (auto& gap : renum.m_gaps)
+        options += " " + std::to_string(gap.after) + ":" + std::to_string(gap.count);
+    options += renum.m_auto_encoding ? " auto" : " " + std::to_string(RENUM_get_encoding());
+    return options;
+}
+
+// the cache key of the input and the options
+bool RENUM_cache_key(RENUM& renum, uint64_t& key)
+{
+    std::string options = RENUM_cache_options(renum);
+    options += " " + std::to_string(RENUM_compression_of_filename(renum.m_options["-o"]));
+
+    FILE *fin = fopen(renum.m_options["-i"].c_str(), "rb");
+    if (!fin)
+        return false;
+
+    // hash the input by the fixed buffer
+    RENUM_HASH_STATE state;
+    RENUM_hash_init(state, RENUM_hash(options.c_str(), options.size()));
+    char buf[64 * 1024];
+    size_t size;
+    while ((size = std::fread(buf, 1, sizeof(buf), fin)) > 0)
+        RENUM_hash_update(state, buf, size);
+    bool ok = !std::ferror(fin);
+    std::fclose(fin);
+    if (!ok)
+        return false;
+
+    key = RENUM_hash_final(state);
+    return true;
+}
+
+// renumber the files in the batch list
+renum_error_t RENUM_renum_batch(RENUM& renum)
+{
+    std::string list;
+    bool bom;
+    renum_error_t error = RENUM_load_file(renum.m_batch, list, bom);
+    if (error)
+        return error;
+
+    std::vector<std::string> lines;
+    mstr_split(lines, list, "\n");
+
+    std::vector<RENUM_BATCH_ITEM> items;
+    for (auto& line : lines)
+    {
+        mstr_trim(line, "\r");
+        if (line.empty())
+            continue;
+
+        RENUM_BATCH_ITEM item;
+        auto ich = line.find('\t');
+        item.input = line.substr(0, ich);
+        item.output = (ich == line.npos) ? item.input : line.substr(ich + 1);
+        items.push_back(item);
+    }
+
+    size_t jobs = renum.m_jobs;
+    if (!jobs)
+        jobs = std::max(1U, std::thread::hardware_concurrency());
+
+    // the cached results by the content
+    std::string cache_options = RENUM_cache_options(renum) + " batch";
+    uint64_t cache_seed = RENUM_hash(cache_options.c_str(), cache_options.size());
+
+    auto fn = [&renum, cache_seed](RENUM_BATCH_ITEM& item, std::string& text, bool bom) {
+        uint64_t cache_key = 0;
+        if (renum.m_cache_dir.size())
+        {
+            cache_key = RENUM_hash(text.c_str(), text.size(), cache_seed + bom);
+            if (RENUM_cache_fetch_text(renum.m_cache_dir, cache_key, text))
+                return 0;
+        }
+
+        if (renum.m_auto_encoding)
+            RENUM_set_encoding(RENUM_detect_encoding(text.c_str(), text.size(), bom));
+        renum_error_t error = RENUM_renumber_text(text, renum.m_new_start, renum.m_old_start,
+                                                  renum.m_step, renum.m_force);
+        if (error)
+            std::fprintf(stderr, "renum: error: Unable to renumber '%s'\n", item.input.c_str());
+        else if (renum.m_cache_dir.size())
+            RENUM_cache_store_text(renum.m_cache_dir, cache_key, text, renum.m_cache_size);
+        return error;
+    };
+
+    if (renum.m_journal.size())
+        return RENUM_run_batch_journaled(items, jobs, renum.m_sync, renum.m_io_engine, renum.m_journal, fn);
+    return RENUM_run_batch(items, jobs, renum.m_sync, renum.m_io_engine, fn);
+}
+
+// the main part of this program / library without the cache
+renum_error_t RENUM_renum_uncached(RENUM& renum)
+{
+    if (renum.m_batch.size())
+        return RENUM_renum_batch(renum);
+
+    if (renum.m_inputs.size() > 1)
+        return RENUM_renum_project(renum);
+
+    if ((renum.m_memory_limit || renum.m_jobs) && !renum.m_check && !renum.m_diff && !renum.m_edits &&
+        !renum.m_minimal)
+    {
+        bool numbered = true;
+        if (FILE *fin = RENUM_fopen_input(renum.m_options["-i"]))
+        {
+            // the head of the file
+            std::string head(64 * 1024, 0);
+            head.resize(std::fread(&head[0], 1, head.size(), fin));
+            std::fclose(fin);
+
+            if (head.compare(0, 3, UTF8_BOM) == 0)
+                head.erase(0, 3);
+            numbered = (head.size() && RENUM_line_number_from_line_text(head) != 0);
+        }
+
+        // the encoding is detected over the whole input while it is read
+
+        // the program without line numbers is numbered in memory
+        if (numbered && !renum.m_memory_limit)
+        {
+            return RENUM_renumber_file_pipelined(renum.m_options["-i"], renum.m_options["-o"], renum.m_jobs,
+                                                 renum.m_new_start, renum.m_old_start, renum.m_step,
+                                                 renum.m_force, renum.m_sync, renum.m_auto_encoding);
+        }
+        if (numbered)
+        {
+            return RENUM_renumber_file(renum.m_options["-i"], renum.m_options["-o"], renum.m_memory_limit,
+                                       renum.m_new_start, renum.m_old_start, renum.m_step,
+                                       renum.m_force, renum.m_sync, renum.m_auto_encoding);
+        }
+    }
+
+    std::string text;
+    renum_error_t error = RENUM_load_file(renum.m_options["-i"], text, renum.m_bom);
+    if (error)
+        return error;
+
+    if (renum.m_auto_encoding)
+        RENUM_set_encoding(RENUM_detect_encoding(text.c_str(), text.size(), renum.m_bom));
+
+    if (renum.m_check)
+    {
+        if (!text.empty() && RENUM_line_number_from_line_text(text, nullptr) == 0)
+        {
+            std::printf("%s: to be numbered\n", renum.m_options["-i"].c_str());
+            return 2;
+        }
+        return RENUM_check(renum, text);
+    }
+
+    if (renum.m_diff || renum.m_edits || renum.m_minimal)
+        return RENUM_renum_edits(renum, text);
+
+    error = RENUM_renumber_text(text, renum.m_new_start, renum.m_old_start, renum.m_step, renum.m_force);
+    if (error)
+        return error;
+
+    error = RENUM_save_file(renum.m_options["-o"], text, renum.m_bom, renum.m_sync);
+    return error;
+}
+
+// the main part of this program / library
+renum_error_t RENUM_renum(RENUM& renum)
+{
+    // use the cached result
+    uint64_t cache_key = 0;
+    bool cache = (renum.m_cache_dir.size() && renum.m_inputs.size() == 1 && renum.m_batch.empty() &&
+                  renum.m_map_file.empty() && renum.m_map_text_file.empty() &&
+                  !renum.m_check && !renum.m_diff && !renum.m_edits);
+    if (cache)
+    {
+        cache = RENUM_cache_key(renum, cache_key);
+        if (cache && RENUM_cache_fetch(renum.m_cache_dir, cache_key, renum.m_options["-o"], renum.m_sync))
+            return 0;
     }
 
-    error = RENUM_save_file(renum.m_options["-o"], text, renum.m_bom);
+    // the map is given by the renumbering itself
+    RENUM_LINE_MAP map;
+    if (renum.m_map_file.size() || renum.m_map_text_file.size())
+        s_renum_line_map = &map;
+    renum_error_t error = RENUM_renum_uncached(renum);
+    s_renum_line_map = nullptr;
+    if (!error && renum.m_map_file.size())
+        error = RENUM_save_line_map(renum.m_map_file, map, false, renum.m_sync);
+    if (!error && renum.m_map_text_file.size())
+        error = RENUM_save_line_map(renum.m_map_text_file, map, true, renum.m_sync);
+    if (!error && cache)
+        RENUM_cache_store(renum.m_cache_dir, cache_key, renum.m_options["-o"], renum.m_cache_size);
     return error;
 }
 
+// renum translate [--all-numbers] MAP [LOG [OUTPUT]]
+int RENUM_translate_main(int argc, char **argv)
+{
+    std::vector<std::string> args;
+    bool all_numbers = false, sync = false;
+    for (int iarg = 2; iarg < argc; ++iarg)
+    {
+        std::string arg = argv[iarg];
+        if (arg == "--help" || arg == "/?")
+        {
+            RENUM_usage();
+            return 0;
+        }
+        if (arg == "--all-numbers")
+        {
+            all_numbers = true;
+            continue;
+        }
+        if (arg == "--sync")
+        {
+            sync = true;
+            continue;
+        }
+        if (arg.size() > 1 && arg[0] == '-')
+        {
+            std::fprintf(stderr, "renum: error: invalid argument '%s'\n", arg.c_str());
+            return 1;
+        }
+        args.push_back(arg);
+    }
+
+    if (args.empty())
+    {
+        std::fprintf(stderr, "renum: error: No line map specified\n");
+        RENUM_usage();
+        return 1;
+    }
+    if (args.size() > 3)
+    {
+        std::fprintf(stderr, "renum: error: invalid argument '%s'\n", args[3].c_str());
+        return 1;
+    }
+    args.resize(3);
+    for (auto& arg : args)
+    {
+        if (arg.empty())
+            arg = "-";
+    }
+
+    return RENUM_translate_file(args[0], args[1], args[2], all_numbers, sync);
+}
+
 int RENUM_main(int argc, char **argv)
 {
     if (argc <= 1)
@@ -756,6 +6101,9 @@ int RENUM_main(int argc, char **argv)
         return 1;
     }
 
+    if (std::strcmp(argv[1], "translate") == 0)
+        return RENUM_translate_main(argc, argv);
+
     RENUM renum;
     renum_error_t error = RENUM_parse_cmdline(renum, argc, argv);
     if (error == -1)
@@ -770,6 +6118,15 @@ int main(int argc, char **argv)
 {
 #ifndef NDEBUG
     RENUM_tokenizer_tests();
+    RENUM_prefilter_tests();
+    RENUM_line_map_tests();
+    RENUM_hash_tests();
+    RENUM_compression_tests();
+    RENUM_merge_tests();
+    RENUM_project_tests();
+    RENUM_check_tests();
+    RENUM_edits_tests();
+    RENUM_C_tests();
 #endif
     return RENUM_main(argc, argv);
 }
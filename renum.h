@@ -5,6 +5,10 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <functional>
 
 #define RENUM_LINENO_START 10
 #define RENUM_LINENO_STEP 10
@@ -12,6 +16,35 @@
 typedef unsigned long renum_lineno_t;   // Line number
 typedef int renum_error_t;              // Error code
 
+// The error codes of RENUM_ERROR_INFO
+enum RENUM_ERROR_CODE
+{
+    RENUM_ERR_NONE = 0,
+    RENUM_ERR_NO_LINE_NUMBER,       // No line number found
+    RENUM_ERR_LINE_NUMBER_EXISTS,   // Line number already exists
+    RENUM_ERR_UNDEFINED_LINE,       // Undefined line
+    RENUM_ERR_UNSORTED_LINE,        // Unsorted line
+    RENUM_ERR_DUPLICATED_LINE,      // Duplicated line
+};
+
+// The information of the last error
+struct RENUM_ERROR_INFO
+{
+    int code;               // RENUM_ERROR_CODE
+    size_t line;            // the physical line index (1-based; 0 if unknown)
+    size_t column;          // the byte column in the line (1-based; 0 if unknown)
+    renum_lineno_t lineno;  // the line number of the line (0 if unknown)
+    renum_lineno_t target;  // the undefined line number
+};
+
+// The encodings of the program text
+enum RENUM_ENCODING
+{
+    RENUM_ENCODING_ASCII,   // byte-transparent (default)
+    RENUM_ENCODING_SJIS,    // Shift_JIS
+    RENUM_ENCODING_UTF8,
+};
+
 /**
  * @brief Displays the version of the renum program.
  */
@@ -56,3 +89,431 @@ renum_error_t RENUM_renumber_lines(
 void RENUM_sort_by_line_numbers(std::string& text);
 // get the line number
 renum_lineno_t RENUM_line_number_from_line_text(const std::string& line, char **endptr = nullptr);
+
+/**
+ * @brief The result of RENUM_check_lines.
+ */
+struct RENUM_CHECK_RESULT
+{
+    // pairs of (line number, undefined target line number)
+    std::vector<std::pair<renum_lineno_t, renum_lineno_t>> undefined;
+    // physical line indexes (1-based) without line number
+    std::vector<size_t> no_line_numbers;
+    // line numbers that are less than the previous line number
+    std::vector<renum_lineno_t> unsorted;
+    // line numbers that appear more than once
+    std::vector<renum_lineno_t> duplicated;
+    // whether RENUM_renumber_lines would not change the text
+    bool canonical = false;
+};
+
+/**
+ * @brief Checks the line numbers of a BASIC program text without rewriting.
+ * @param text The BASIC program text to check.
+ * @param result Receives the problems found and the verdict.
+ * @param new_start The new starting line number (default: 10).
+ * @param old_start The old starting line number (default: 0).
+ * @param step The increment step between lines (default: 10).
+ * @param stop_early Stop at the first problem found.
+ * @return Error code (0 if no problem found).
+ */
+renum_error_t RENUM_check_lines(
+    const std::string& text,
+    RENUM_CHECK_RESULT& result,
+    renum_lineno_t new_start = RENUM_LINENO_START,
+    renum_lineno_t old_start = 0,
+    renum_lineno_t step = RENUM_LINENO_STEP,
+    bool stop_early = false);
+
+/**
+ * @brief An edit of the text generated by RENUM_renumber_edits.
+ */
+struct RENUM_EDIT
+{
+    size_t offset;          // byte offset in the original text
+    std::string old_text;   // the text to be replaced
+    std::string new_text;   // the replacement text
+};
+
+/**
+ * @brief Renumbers the lines of a sorted BASIC program text as a list of edits.
+ *
+ * The edits also normalize the spaces, CR and the end of the text as
+ * RENUM_renumber_lines does, so applying them gives the same text. The lines
+ * are never moved, so unsorted lines are an error.
+ * @param text The BASIC program text. Its line numbers must be sorted.
+ * @param edits Receives the edits in ascending order of offset.
+ * @param new_start The new starting line number (default: 10).
+ * @param old_start The old starting line number (default: 0).
+ * @param step The increment step between lines (default: 10).
+ * @param force Force renumbering even if an invalid line number is encountered.
+ * @return Error code (0 for success).
+ */
+renum_error_t RENUM_renumber_edits(
+    const std::string& text,
+    std::vector<RENUM_EDIT>& edits,
+    renum_lineno_t new_start = RENUM_LINENO_START,
+    renum_lineno_t old_start = 0,
+    renum_lineno_t step = RENUM_LINENO_STEP,
+    bool force = false);
+
+/**
+ * @brief A gap to be made for inserting lines by RENUM_renumber_minimal.
+ */
+struct RENUM_GAP
+{
+    renum_lineno_t after;   // the old line number before the gap
+    renum_lineno_t count;   // the number of the line numbers to be left unused
+};
+
+/**
+ * @brief Renumbers as few lines as possible to make the gaps and the ascending order.
+ *
+ * The lines are not sorted. The line numbers become ascending in the order
+ * of the lines, and the lines and the references of the most are kept.
+ * @param text The BASIC program text.
+ * @param edits Receives the edits in ascending order of offset.
+ * @param gaps The gaps to be made.
+ * @param step The increment step for the lines after the last kept line (default: 10).
+ * @param force Force renumbering even if an invalid line number is encountered.
+ * @return Error code (0 for success).
+ */
+renum_error_t RENUM_renumber_minimal(
+    const std::string& text,
+    std::vector<RENUM_EDIT>& edits,
+    const std::vector<RENUM_GAP>& gaps,
+    renum_lineno_t step = RENUM_LINENO_STEP,
+    bool force = false);
+
+// apply the edits to the text
+void RENUM_apply_edits(std::string& text, const std::vector<RENUM_EDIT>& edits);
+// generate a unified diff of the edits
+void RENUM_unified_diff(
+    std::string& diff,
+    const std::string& filename,
+    const std::string& text,
+    const std::vector<RENUM_EDIT>& edits);
+// generate an edit list (offset, old text and new text separated by tabs)
+void RENUM_edit_list(std::string& list, const std::vector<RENUM_EDIT>& edits);
+
+/**
+ * @brief A segment of the output.
+ */
+struct RENUM_SEGMENT
+{
+    const char *data;
+    size_t size;
+};
+
+/**
+ * @brief Saves the segments to a file by writing a temporary file and renaming it.
+ * @param filename The destination file.
+ * @param segments The segments to be written in order.
+ * @param count The number of the segments.
+ * @param sync Flush the file to the storage before renaming.
+ * @return Error code (0 for success).
+ */
+renum_error_t RENUM_save_segments(
+    const std::string& filename,
+    const RENUM_SEGMENT *segments,
+    size_t count,
+    bool sync = false);
+
+// load a text file
+renum_error_t RENUM_load_file(const std::string& filename, std::string& text, bool& bom);
+// save a text file atomically
+renum_error_t RENUM_save_file(const std::string& filename, const std::string& text, bool bom, bool sync = false);
+
+/**
+ * @brief A file of a project for RENUM_renumber_project.
+ */
+struct RENUM_PROJECT_FILE
+{
+    std::string filename;       // the file name for messages
+    std::string text;           // the program text to modify
+    renum_lineno_t first = 0;   // receives the first new line number
+    renum_lineno_t last = 0;    // receives the last new line number
+};
+
+/**
+ * @brief Renumbers the files of a program sharing one line number space (MERGE/CHAIN).
+ * @param files The files of the program in order.
+ * @param new_start The new starting line number (default: 10).
+ * @param old_start The old starting line number (default: 0).
+ * @param step The increment step between lines (default: 10).
+ * @param force Force renumbering even if an invalid line number is encountered.
+ * @return Error code (0 for success).
+ */
+renum_error_t RENUM_renumber_project(
+    std::vector<RENUM_PROJECT_FILE>& files,
+    renum_lineno_t new_start = RENUM_LINENO_START,
+    renum_lineno_t old_start = 0,
+    renum_lineno_t step = RENUM_LINENO_STEP,
+    bool force = false);
+
+/**
+ * @brief Renumbers a BASIC program file with bounded memory.
+ *
+ * The lines are sorted by an external merge sort. The sorted runs larger
+ * than the memory budget are spilled to temporary files, and merged by 64
+ * runs at most in several passes.
+ * @param in_filename The input file.
+ * @param out_filename The output file.
+ * @param memory_budget The approximate maximum size of a sorted run in bytes.
+ * @param new_start The new starting line number (default: 10).
+ * @param old_start The old starting line number (default: 0).
+ * @param step The increment step between lines (default: 10).
+ * @param force Force renumbering even if an invalid line number is encountered.
+ * @param sync Flush the output file to the storage before renaming.
+ * @param auto_encoding Detect the encoding over the whole input while reading it.
+ * @return Error code (0 for success).
+ */
+renum_error_t RENUM_renumber_file(
+    const std::string& in_filename,
+    const std::string& out_filename,
+    size_t memory_budget,
+    renum_lineno_t new_start = RENUM_LINENO_START,
+    renum_lineno_t old_start = 0,
+    renum_lineno_t step = RENUM_LINENO_STEP,
+    bool force = false,
+    bool sync = false,
+    bool auto_encoding = false);
+
+/**
+ * @brief Renumbers a BASIC program file by the pipelined reader, rewriter and writer stages.
+ * @param in_filename The input file.
+ * @param out_filename The output file.
+ * @param jobs The number of the rewriter threads.
+ * @param new_start The new starting line number (default: 10).
+ * @param old_start The old starting line number (default: 0).
+ * @param step The increment step between lines (default: 10).
+ * @param force Force renumbering even if an invalid line number is encountered.
+ * @param sync Flush the output file to the storage before renaming.
+ * @param auto_encoding Detect the encoding over the whole input while reading it.
+ * @return Error code (0 for success).
+ */
+renum_error_t RENUM_renumber_file_pipelined(
+    const std::string& in_filename,
+    const std::string& out_filename,
+    size_t jobs,
+    renum_lineno_t new_start = RENUM_LINENO_START,
+    renum_lineno_t old_start = 0,
+    renum_lineno_t step = RENUM_LINENO_STEP,
+    bool force = false,
+    bool sync = false,
+    bool auto_encoding = false);
+
+// set the encoding of the program text for the tokenizer of the calling thread
+void RENUM_set_encoding(RENUM_ENCODING encoding);
+// get the encoding of the program text for the tokenizer of the calling thread
+RENUM_ENCODING RENUM_get_encoding(void);
+// detect the encoding of the program text (ASCII if no non-ASCII byte)
+RENUM_ENCODING RENUM_detect_encoding(const char *text, size_t len, bool bom);
+
+// get the last error of the calling thread
+const RENUM_ERROR_INFO& RENUM_get_last_error(void);
+// suppress the error messages of the calling thread
+void RENUM_set_quiet(bool quiet);
+
+// the running state of RENUM_hash
+struct RENUM_HASH_STATE
+{
+    uint64_t m_hash;
+    uint64_t m_size;
+    unsigned char m_tail[8];    // the bytes not hashed yet
+    size_t m_cTail;
+};
+
+// a fast 64-bit hash
+uint64_t RENUM_hash(const void *data, size_t size, uint64_t seed = 0);
+// hash incrementally (the same value as RENUM_hash of the whole data)
+void RENUM_hash_init(RENUM_HASH_STATE& state, uint64_t seed = 0);
+void RENUM_hash_update(RENUM_HASH_STATE& state, const void *data, size_t size);
+uint64_t RENUM_hash_final(RENUM_HASH_STATE& state);
+
+/**
+ * @brief The statistics of the result cache.
+ */
+struct RENUM_CACHE_STATS
+{
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+    unsigned long long entries = 0;
+    unsigned long long size = 0;
+};
+
+/**
+ * @brief Gets the cached result and writes it to the output file.
+ * @param cache_dir The cache directory.
+ * @param key The hash of the input and the options.
+ * @param out_filename The output file.
+ * @param sync Flush the output file to the storage before renaming.
+ * @return true if the result is cached.
+ */
+bool RENUM_cache_fetch(const std::string& cache_dir, uint64_t key, const std::string& out_filename, bool sync = false);
+
+/**
+ * @brief Stores the output file to the cache and evicts the least recently used entries.
+ * @param cache_dir The cache directory.
+ * @param key The hash of the input and the options.
+ * @param out_filename The output file.
+ * @param max_size The maximum total size of the cache entries in bytes.
+ * @return Error code (0 for success).
+ */
+renum_error_t RENUM_cache_store(
+    const std::string& cache_dir,
+    uint64_t key,
+    const std::string& out_filename,
+    unsigned long long max_size);
+
+/**
+ * @brief Gets the cached text.
+ * @param cache_dir The cache directory.
+ * @param key The hash of the input and the options.
+ * @param text Receives the cached text.
+ * @return true if the text is cached.
+ */
+bool RENUM_cache_fetch_text(const std::string& cache_dir, uint64_t key, std::string& text);
+
+/**
+ * @brief Stores the text to the cache and evicts the least recently used entries.
+ *
+ * The cache directory is scanned only when the counted total size exceeds
+ * max_size.
+ * @param cache_dir The cache directory.
+ * @param key The hash of the input and the options.
+ * @param text The text to be cached.
+ * @param max_size The maximum total size of the cache entries in bytes.
+ * @return Error code (0 for success).
+ */
+renum_error_t RENUM_cache_store_text(
+    const std::string& cache_dir,
+    uint64_t key,
+    const std::string& text,
+    unsigned long long max_size);
+
+// get the statistics of the cache
+void RENUM_cache_stats(const std::string& cache_dir, RENUM_CACHE_STATS& stats);
+
+/**
+ * @brief Renumbers a program text in the usual way.
+ *
+ * If the first line has no line number, the line numbers are added.
+ * Otherwise the lines are sorted and renumbered.
+ * @return Error code (0 for success).
+ */
+renum_error_t RENUM_renumber_text(
+    std::string& text,
+    renum_lineno_t new_start = RENUM_LINENO_START,
+    renum_lineno_t old_start = 0,
+    renum_lineno_t step = RENUM_LINENO_STEP,
+    bool force = false);
+
+/**
+ * @brief An item of the batch processing.
+ */
+struct RENUM_BATCH_ITEM
+{
+    std::string input;          // the input file
+    std::string output;         // the output file
+    renum_error_t error = 0;    // receives the error code
+};
+
+// the function to process the text of a batch item (the BOM is stripped)
+typedef std::function<renum_error_t(RENUM_BATCH_ITEM& item, std::string& text, bool bom)> RENUM_BATCH_FN;
+
+// the function called when a batch item is finished (successfully or not)
+typedef std::function<void(RENUM_BATCH_ITEM& item)> RENUM_BATCH_DONE_FN;
+
+// The I/O engines of the batch processing
+enum RENUM_IO_ENGINE
+{
+    RENUM_IO_AUTO,      // io_uring if available, otherwise the thread pool
+    RENUM_IO_THREADS,   // the thread pool
+    RENUM_IO_URING,     // io_uring (Linux only)
+};
+
+/**
+ * @brief Processes many files by the asynchronous I/O engine.
+ *
+ * The files are read and written asynchronously and the texts are
+ * processed by the worker threads. The outputs are replaced atomically.
+ * @param items The items to process.
+ * @param jobs The number of the worker threads.
+ * @param sync Flush the output files to the storage before renaming.
+ * @param engine The I/O engine.
+ * @param fn The function to process the text.
+ * @param done The function called when each item is finished (optional).
+ * @return Error code (0 if all the items succeeded).
+ */
+renum_error_t RENUM_run_batch(
+    std::vector<RENUM_BATCH_ITEM>& items,
+    size_t jobs,
+    bool sync,
+    RENUM_IO_ENGINE engine,
+    const RENUM_BATCH_FN& fn,
+    const RENUM_BATCH_DONE_FN& done = RENUM_BATCH_DONE_FN());
+
+/**
+ * @brief Processes many files resumably by the journal.
+ *
+ * The finished items are appended to the journal with the hashes of the outputs.
+ * The items recorded in the journal are skipped if the inputs are unchanged and
+ * the outputs have the recorded hashes.
+ * @param journal_filename The journal file.
+ * @return Error code (0 if all the items succeeded).
+ * @see RENUM_run_batch
+ */
+renum_error_t RENUM_run_batch_journaled(
+    std::vector<RENUM_BATCH_ITEM>& items,
+    size_t jobs,
+    bool sync,
+    RENUM_IO_ENGINE engine,
+    const std::string& journal_filename,
+    const RENUM_BATCH_FN& fn);
+
+// the map of the old and new line numbers (sorted by the old ones)
+typedef std::vector<std::pair<renum_lineno_t, renum_lineno_t>> RENUM_LINE_MAP;
+
+/**
+ * @brief Gets the map of the old and new line numbers of a file to be renumbered.
+ * @param filename The input file.
+ * @param map Receives the map.
+ * @return Error code (0 for success).
+ */
+renum_error_t RENUM_line_map_of_file(
+    const std::string& filename,
+    RENUM_LINE_MAP& map,
+    renum_lineno_t new_start = RENUM_LINENO_START,
+    renum_lineno_t old_start = 0,
+    renum_lineno_t step = RENUM_LINENO_STEP);
+
+/**
+ * @brief Saves the map of the old and new line numbers.
+ *
+ * The binary map is a hash table to be memory-mapped by RENUM_translate_file.
+ * The text map has the old and new line numbers separated by a tab per line.
+ * @return Error code (0 for success).
+ */
+renum_error_t RENUM_save_line_map(
+    const std::string& filename,
+    const RENUM_LINE_MAP& map,
+    bool text_format = false,
+    bool sync = false);
+
+/**
+ * @brief Translates the old line numbers in a log file to the new ones.
+ *
+ * The numbers after the word "in", "line" or "at" (or all the numbers) are translated.
+ * @param map_filename The binary or text map file.
+ * @param in_filename The input log file ("-" for stdin).
+ * @param out_filename The output file ("-" for stdout).
+ * @param all_numbers Translate all the numbers.
+ * @return Error code (0 for success).
+ */
+renum_error_t RENUM_translate_file(
+    const std::string& map_filename,
+    const std::string& in_filename,
+    const std::string& out_filename,
+    bool all_numbers = false,
+    bool sync = false);